@@ -0,0 +1,85 @@
+#include "bench.hpp"
+
+// Steady-state allocations of the generation paths writing into caller buffers: after a
+// warm-up, none of them may allocate. Exits with a failure status otherwise.
+
+static int g_Failures = 0;
+
+template<typename F>
+static void Check(const std::string& name, F&& func) {
+    const size_t warmup = 10000;
+    const size_t iterations = 200000;
+    func(warmup);
+    double seconds = bench::Measure([&]() { func(iterations); });
+    bench::Report(name, iterations, seconds, "names");
+    if(bench::g_LastSample.allocations > 0) {
+        printf("FAIL: %s made %lu allocations\n", name.c_str(), (unsigned long) bench::g_LastSample.allocations);
+        g_Failures++;
+    }
+}
+
+int main() {
+    const std::string words = "data/lists/english-words.txt";
+    const std::string templates = "data/templates/rinkworks.txt";
+    std::string buffer;
+
+    nage::ListGenerator list(words);
+    Check("steady/list/generate-into", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++) {
+            list.GenerateInto(buffer);
+            bench::DoNotOptimize(buffer.data());
+        }
+    });
+
+    nage::MarkovChainGenerator markov(3);
+    markov.Compute(words);
+    Check("steady/markov/generate-into", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++) {
+            markov.GenerateInto(buffer);
+            bench::DoNotOptimize(buffer.data());
+        }
+    });
+
+    nage::TemplateGenerator generator(templates);
+    nage::CompiledTemplate compiled = generator.Compile("(zh|x|q|sh|h)(ao|ian|uo|ou|ia)(|(l|w|c|p|b|m)(ao|ian|uo|ou|ia)(|n)|-<s>)");
+    Check("steady/template/generate-into", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++) {
+            generator.GenerateInto(compiled, buffer);
+            bench::DoNotOptimize(buffer.data());
+        }
+    });
+
+    nage::PreparedGenerator<nage::MarkovChainGenerator> prepared = markov.Prepare<nage::MarkovChainGenerator>()
+        .Filter([](std::string_view name) { return name.size() > 4; })
+        .Filter([](std::string_view name) { return name.find('q') == std::string_view::npos; })
+        .Edit([](std::string& name) { name[0] = toupper(name[0]); });
+    Check("steady/prepared/try-get", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++) {
+            prepared.TryGet(buffer);
+            bench::DoNotOptimize(buffer.data());
+        }
+    });
+
+    nage::PreparedGenerator<nage::ListGenerator> capitalized = list.Prepare<nage::ListGenerator>()
+        .Edit([](std::string name) {
+            name[0] = toupper(name[0]);
+            return name;
+        });
+    Check("steady/prepared/try-get-returning-edit", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++) {
+            capitalized.TryGet(buffer);
+            bench::DoNotOptimize(buffer.data());
+        }
+    });
+
+    nage::NameTable names;
+    Check("steady/prepared/get-n", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i += 1000) {
+            names.Clear();
+            prepared.GetN(1000, names);
+            bench::DoNotOptimize(names.Data().data());
+        }
+    });
+
+    return g_Failures > 0 ? 1 : 0;
+}
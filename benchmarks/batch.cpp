@@ -0,0 +1,55 @@
+#include "bench.hpp"
+
+// Compares looping on PreparedGenerator::Get() with a single GetN() call.
+
+template<typename G>
+void Run(const std::string& name, G* generator, size_t count) {
+    nage::PreparedGenerator<G> prepared = generator->template Prepare<G>();
+    nage::PreparedGenerator<G> filtered = generator->template Prepare<G>()
+        .Filter([](const std::string& name) { return name.size() > 3; });
+
+    double seconds = bench::Measure([&]() {
+        std::vector<std::string> names;
+        names.reserve(count);
+        for(size_t i = 0; i < count; i++)
+            names.push_back(prepared.Get());
+        bench::DoNotOptimize(names.data());
+    });
+    bench::Report(name + "/get", count, seconds);
+
+    seconds = bench::Measure([&]() {
+        nage::NameTable names;
+        prepared.GetN(count, names);
+        bench::DoNotOptimize(names.Data().data());
+    });
+    bench::Report(name + "/get-n", count, seconds);
+
+    seconds = bench::Measure([&]() {
+        std::vector<std::string> names;
+        names.reserve(count);
+        for(size_t i = 0; i < count; i++)
+            names.push_back(filtered.Get());
+        bench::DoNotOptimize(names.data());
+    });
+    bench::Report(name + "/filtered/get", count, seconds);
+
+    seconds = bench::Measure([&]() {
+        nage::NameTable names;
+        filtered.GetN(count, names);
+        bench::DoNotOptimize(names.Data().data());
+    });
+    bench::Report(name + "/filtered/get-n", count, seconds);
+}
+
+int main() {
+    const size_t count = 1000000;
+
+    nage::ListGenerator list("data/lists/english-words.txt");
+    Run("list", &list, count);
+
+    nage::MarkovChainGenerator markov(3);
+    markov.Compute("data/lists/english-words.txt");
+    Run("markov", &markov, count);
+
+    return 0;
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+#include "../nage.hpp"
+
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+
+// Minimal benchmark harness. Every result is printed as ns/op, allocations/op and
+// operations/s, and written in the JSON format of Google Benchmark to the file named by
+// the NAGE_BENCH_JSON environment variable, so that runs can be compared release to
+// release (e.g. with Google Benchmark's compare.py).
+
+namespace bench {
+
+    using Clock = std::chrono::steady_clock;
+
+    inline std::atomic<uint64_t> g_Allocations = 0;
+    inline std::atomic<uint64_t> g_AllocatedBytes = 0;
+
+    struct Sample {
+        double seconds = 0;
+        double cpuSeconds = 0;
+        uint64_t allocations = 0;
+        uint64_t bytes = 0;
+    };
+
+    struct Result {
+        std::string name;
+        std::string unit;
+        double operations;
+        Sample sample;
+    };
+
+    // Results of the process, written as JSON on exit.
+    class Suite {
+        public:
+            ~Suite() {
+                const char* fileName = getenv("NAGE_BENCH_JSON");
+                if(fileName == nullptr || m_Results.empty())
+                    return;
+                FILE* file = fopen(fileName, "w");
+                if(file == nullptr)
+                    return;
+
+                char date[64];
+                time_t now = time(nullptr);
+                strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+                fprintf(file, "{\n  \"context\": {\n");
+                fprintf(file, "    \"date\": \"%s\",\n", date);
+                fprintf(file, "    \"num_cpus\": %u,\n", std::thread::hardware_concurrency());
+                fprintf(file, "    \"compiler\": \"%s\",\n", __VERSION__);
+                fprintf(file, "    \"library_build_type\": \"release\"\n  },\n  \"benchmarks\": [\n");
+                for(size_t i = 0; i < m_Results.size(); i++) {
+                    const Result& result = m_Results[i];
+                    double operations = result.operations;
+                    fprintf(file, "    {\n");
+                    fprintf(file, "      \"name\": \"%s\",\n", result.name.c_str());
+                    fprintf(file, "      \"run_type\": \"iteration\",\n");
+                    fprintf(file, "      \"iterations\": %.0f,\n", operations);
+                    fprintf(file, "      \"real_time\": %.3f,\n", result.sample.seconds * 1e9 / operations);
+                    fprintf(file, "      \"cpu_time\": %.3f,\n", result.sample.cpuSeconds * 1e9 / operations);
+                    fprintf(file, "      \"time_unit\": \"ns\",\n");
+                    fprintf(file, "      \"allocs_per_iter\": %.3f,\n", result.sample.allocations / operations);
+                    fprintf(file, "      \"bytes_per_iter\": %.3f,\n", result.sample.bytes / operations);
+                    fprintf(file, "      \"items_per_second\": %.1f,\n", operations / result.sample.seconds);
+                    fprintf(file, "      \"label\": \"%s\"\n", result.unit.c_str());
+                    fprintf(file, "    }%s\n", i + 1 < m_Results.size() ? "," : "");
+                }
+                fprintf(file, "  ]\n}\n");
+                fclose(file);
+            }
+
+            void Add(const Result& result) {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_Results.push_back(result);
+            }
+        private:
+            std::mutex m_Mutex;
+            std::vector<Result> m_Results;
+    };
+
+    inline Suite& GetSuite() {
+        static Suite suite;
+        return suite;
+    }
+
+    // Figures of the last Measure() or MeasureThreads(), picked up by Report().
+    inline Sample g_LastSample;
+
+    inline Sample Begin() {
+        Sample sample;
+        sample.cpuSeconds = (double) clock() / CLOCKS_PER_SEC;
+        sample.allocations = g_Allocations.load(std::memory_order_relaxed);
+        sample.bytes = g_AllocatedBytes.load(std::memory_order_relaxed);
+        return sample;
+    }
+
+    inline Sample End(const Sample& begin, double seconds) {
+        Sample sample;
+        sample.seconds = seconds;
+        sample.cpuSeconds = (double) clock() / CLOCKS_PER_SEC - begin.cpuSeconds;
+        sample.allocations = g_Allocations.load(std::memory_order_relaxed) - begin.allocations;
+        sample.bytes = g_AllocatedBytes.load(std::memory_order_relaxed) - begin.bytes;
+        g_LastSample = sample;
+        return sample;
+    }
+
+    // Runs `func` once and returns the elapsed time in seconds.
+    template<typename F>
+    inline double Measure(F&& func) {
+        Sample begin = Begin();
+        auto start = Clock::now();
+        func();
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        return End(begin, seconds).seconds;
+    }
+
+    // Runs `func(thread)` on `threads` threads started together and returns the elapsed time.
+    template<typename F>
+    inline double MeasureThreads(size_t threads, F&& func) {
+        std::vector<std::thread> workers;
+        std::atomic<bool> go = false;
+        std::atomic<size_t> ready = 0;
+        for(size_t i = 0; i < threads; i++) {
+            workers.emplace_back([&, i]() {
+                ready++;
+                while(!go)
+                    std::this_thread::yield();
+                func(i);
+            });
+        }
+        while(ready < threads)
+            std::this_thread::yield();
+
+        Sample begin = Begin();
+        auto start = Clock::now();
+        go = true;
+        for(auto& worker : workers)
+            worker.join();
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        return End(begin, seconds).seconds;
+    }
+
+    // Prints and records the last measure as `operations` operations of the given unit.
+    inline void Report(const std::string& name, double operations, double seconds, const std::string& unit = "ops") {
+        Sample sample = g_LastSample;
+        sample.seconds = seconds;
+        printf("%-44s %12.1f ns/op %10.2f allocs/op %14.0f %s/s\n", name.c_str(), seconds * 1e9 / operations,
+            sample.allocations / operations, operations / seconds, unit.c_str());
+        GetSuite().Add({name, unit, operations, sample});
+    }
+
+    // Prints and records the 50th, 99th and 99.9th percentiles of latencies in seconds.
+    inline void ReportLatency(const std::string& name, std::vector<double> latencies, const std::string& unit = "requests") {
+        if(latencies.empty())
+            return;
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p) {
+            return latencies[std::min(latencies.size() - 1, (size_t) (p * latencies.size()))];
+        };
+        printf("%-44s %12.1f us p50 %10.1f us p99 %10.1f us p99.9\n", name.c_str(),
+            percentile(0.5) * 1e6, percentile(0.99) * 1e6, percentile(0.999) * 1e6);
+        for(auto [suffix, p] : {std::make_pair("/p50", 0.5), std::make_pair("/p99", 0.99), std::make_pair("/p99.9", 0.999)}) {
+            Sample sample;
+            sample.seconds = sample.cpuSeconds = percentile(p);
+            GetSuite().Add({name + suffix, unit, 1, sample});
+        }
+    }
+
+    // Runs `func(iterations)` with a growing number of iterations until it lasts at least
+    // `minTime` seconds, then reports it.
+    template<typename F>
+    inline void Run(const std::string& name, F&& func, const std::string& unit = "names", double minTime = 0.25) {
+        size_t iterations = 1;
+        while(true) {
+            double seconds = Measure([&]() { func(iterations); });
+            if(seconds >= minTime || iterations >= ((size_t) 1 << 40)) {
+                Report(name, iterations, seconds, unit);
+                return;
+            }
+            double scale = seconds > 0 ? minTime * 1.4 / seconds : 100;
+            iterations = (size_t) (iterations * std::clamp(scale, 2.0, 100.0));
+        }
+    }
+
+    // Keeps the compiler from optimizing away a result.
+    template<typename T>
+    inline void DoNotOptimize(const T& value) {
+        asm volatile("" : : "r,m"(value) : "memory");
+    }
+
+    inline size_t MaxThreads() {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+// Counting allocator: every benchmark is a single translation unit including this header.
+// GCC wrongly pairs the inlined malloc() and free() with new and delete.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size) {
+    bench::g_Allocations.fetch_add(1, std::memory_order_relaxed);
+    bench::g_AllocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    if(void* pointer = malloc(size > 0 ? size : 1))
+        return pointer;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept {
+    free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+    free(pointer);
+}
@@ -0,0 +1,110 @@
+#include "bench.hpp"
+
+// Load generator for the executor: client threads send requests of 1 to 8 names to
+// generators of the handler and wait for them, one at a time (closed loop) or with a
+// window of outstanding requests. Reports throughput and request latencies, against
+// clients calling the generators themselves.
+
+using Clock = bench::Clock;
+
+static const double DURATION = 1.0;
+
+static double Elapsed(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static nage::Executor::Request MakeRequest(nage::Random& random) {
+    nage::Executor::Request request;
+    request.generator = random.NextBelow(2);
+    request.count = 1 + random.NextBelow(8);
+    return request;
+}
+
+static void Load(const std::string& name, nage::Executor& executor, size_t clients, size_t window) {
+    std::vector<std::vector<double>> latencies(clients);
+    std::atomic<uint64_t> names = 0;
+    double seconds = bench::MeasureThreads(clients, [&](size_t client) {
+        nage::Random random(client + 1);
+        std::deque<std::pair<Clock::time_point, std::future<nage::NameTable>>> outstanding;
+        Clock::time_point start = Clock::now();
+        while(Elapsed(start) < DURATION || !outstanding.empty()) {
+            while(outstanding.size() < window && Elapsed(start) < DURATION)
+                outstanding.emplace_back(Clock::now(), executor.Submit(MakeRequest(random)));
+            auto& [submitted, future] = outstanding.front();
+            names += future.get().Size();
+            latencies[client].push_back(Elapsed(submitted));
+            outstanding.pop_front();
+        }
+    });
+    bench::Report(name, names, seconds, "names");
+    std::vector<double> all;
+    for(auto& client : latencies)
+        all.insert(all.end(), client.begin(), client.end());
+    bench::ReportLatency(name, all);
+}
+
+int main() {
+    nage::Init();
+    auto markov = nage::Make<nage::MarkovChainGenerator>(3);
+    markov->Compute("data/lists/german-cities.txt");
+    nage::Put(0, std::move(markov));
+    nage::Put(1, nage::Make<nage::ListGenerator>("data/lists/english-words.txt"));
+
+    size_t clients = bench::MaxThreads() * 2;
+
+    // Baseline: every client generates by itself.
+    {
+        std::vector<std::vector<double>> latencies(clients);
+        std::atomic<uint64_t> names = 0;
+        double seconds = bench::MeasureThreads(clients, [&](size_t client) {
+            nage::Random random(client + 1);
+            Clock::time_point start = Clock::now();
+            while(Elapsed(start) < DURATION) {
+                nage::Executor::Request request = MakeRequest(random);
+                Clock::time_point submitted = Clock::now();
+                nage::NameTable table;
+                nage::Acquire<nage::Generator>(request.generator)->GenerateN(request.count, table);
+                names += table.Size();
+                latencies[client].push_back(Elapsed(submitted));
+            }
+        });
+        std::string name = "direct/" + std::to_string(clients) + "-clients";
+        bench::Report(name, names, seconds, "names");
+        std::vector<double> all;
+        for(auto& client : latencies)
+            all.insert(all.end(), client.begin(), client.end());
+        bench::ReportLatency(name, all);
+    }
+
+    {
+        nage::Executor executor(bench::MaxThreads());
+        Load("executor/closed-loop/" + std::to_string(clients) + "-clients", executor, clients, 1);
+        Load("executor/window-32/" + std::to_string(clients) + "-clients", executor, clients, 32);
+    }
+
+    // Backpressure: a small queue rejects what it cannot hold.
+    {
+        nage::Executor executor(1, 64);
+        nage::Random random(1);
+        size_t accepted = 0, rejected = 0;
+        std::vector<std::future<nage::NameTable>> futures;
+        double seconds = bench::Measure([&]() {
+            for(size_t i = 0; i < 100000; i++) {
+                std::future<nage::NameTable> future;
+                if(executor.TrySubmit(MakeRequest(random), future)) {
+                    futures.push_back(std::move(future));
+                    accepted++;
+                }
+                else
+                    rejected++;
+            }
+            for(auto& future : futures)
+                future.get();
+        });
+        bench::Report("executor/try-submit/capacity-64", 100000, seconds, "requests");
+        printf("%-44s %12zu accepted %10zu rejected\n", "", accepted, rejected);
+    }
+
+    nage::Free();
+    return 0;
+}
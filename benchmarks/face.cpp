@@ -0,0 +1,19 @@
+#include "bench.hpp"
+
+// Face composition, one by one into a reused buffer and in batches of a million faces.
+
+int main() {
+    nage::FaceGenerator generator("data/faces/male.txt");
+    std::string face;
+    bench::Run("face/generate-into", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++) {
+            generator.GenerateInto(face);
+            bench::DoNotOptimize(face.data());
+        }
+    }, "faces");
+
+    nage::NameTable faces;
+    double seconds = bench::Measure([&]() { generator.GenerateN(1000000, faces); });
+    bench::Report("face/generate-n/1000000", faces.Size(), seconds, "faces");
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include "bench.hpp"
+
+// Micro and macro benchmarks of every generator on the files under data/.
+
+int main() {
+    const std::string words = "data/lists/english-words.txt";
+    const std::string cities = "data/lists/german-cities.txt";
+    const std::string templates = "data/templates/rinkworks.txt";
+    const std::string cache = "bin/bench-markov.bin";
+
+    // List
+    nage::ListGenerator list(words);
+    bench::Run("list/generate", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++)
+            bench::DoNotOptimize(list.Generate());
+    });
+    bench::Run("list/add-from-file", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++) {
+            nage::ListGenerator loaded(words);
+            bench::DoNotOptimize(loaded.Size());
+        }
+    }, "files");
+
+    // Markov
+    nage::MarkovChainGenerator markov(3);
+    markov.Compute(words);
+    bench::Run("markov/generate", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++)
+            bench::DoNotOptimize(markov.Generate());
+    });
+    for(auto& [name, fileName] : {std::make_pair("cities", cities), std::make_pair("words", words)}) {
+        bench::Run(std::string("markov/compute/") + name, [&](size_t iterations) {
+            for(size_t i = 0; i < iterations; i++) {
+                nage::MarkovChainGenerator computed(3);
+                computed.Compute(fileName);
+            }
+        }, "files");
+    }
+    bench::Run("markov/save", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++)
+            markov.Save(cache);
+    }, "files");
+    bench::Run("markov/load", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++) {
+            nage::MarkovChainGenerator loaded(3);
+            loaded.Load(cache);
+        }
+    }, "files");
+    bench::Run("markov/load-verified", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++) {
+            nage::MarkovChainGenerator loaded(3);
+            loaded.Load(cache, true);
+        }
+    }, "files");
+
+    // Template
+    nage::TemplateGenerator generator(templates);
+    const std::string expr = "(zh|x|q|sh|h)(ao|ian|uo|ou|ia)(|(l|w|c|p|b|m)(ao|ian|uo|ou|ia)(|n)|-(l|w|c|p|b|m)(ao|ian|uo|ou|ia)(|(d|j|q|l)(a|ai|iu|ao|i)))";
+    bench::Run("template/evaluate", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++) {
+            std::string copy = expr;
+            bench::DoNotOptimize(generator.Evaluate(copy));
+        }
+    });
+    nage::CompiledTemplate compiled = generator.Compile(expr);
+    bench::Run("template/generate-compiled", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++)
+            bench::DoNotOptimize(generator.Generate(compiled));
+    });
+    bench::Run("template/load-templates", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++) {
+            nage::TemplateGenerator loaded;
+            loaded.LoadTemplates(templates);
+        }
+    }, "files");
+
+    // Prepared
+    nage::PreparedGenerator<nage::MarkovChainGenerator> prepared = markov.Prepare<nage::MarkovChainGenerator>()
+        .Filter([](const std::string& name) { return name.size() > 4; })
+        .Filter([](const std::string& name) { return name.find('q') == std::string::npos; })
+        .Edit([](std::string name) {
+            name[0] = toupper(name[0]);
+            return name;
+        });
+    bench::Run("prepared/markov/get-filtered", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++)
+            bench::DoNotOptimize(prepared.Get());
+    });
+    bench::Run("prepared/markov/get-n-filtered", [&](size_t iterations) {
+        nage::NameTable names;
+        prepared.GetN(iterations, names);
+        bench::DoNotOptimize(names.Data().data());
+    });
+
+    return 0;
+}
@@ -0,0 +1,42 @@
+#include "bench.hpp"
+
+// Measures Handler lookup throughput while the number of reader threads grows,
+// with and without a writer replacing generators in the background.
+
+int main() {
+    nage::Init();
+
+    const uint32_t keys = 64;
+    const size_t lookups = 2000000;
+
+    for(uint32_t key = 0; key < keys; key++)
+        nage::Put(key, nage::Make<nage::ListGenerator>(std::vector<std::string>{"a", "b", "c"}));
+
+    for(bool reload : {false, true}) {
+        std::atomic<bool> done = false;
+        std::thread writer;
+        if(reload) {
+            writer = std::thread([&]() {
+                for(uint32_t i = 0; !done; i++) {
+                    nage::Put(i % keys, nage::Make<nage::ListGenerator>(std::vector<std::string>{"d", "e"}));
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            });
+        }
+
+        for(size_t threads = 1; threads <= bench::MaxThreads() * 2; threads *= 2) {
+            double seconds = bench::MeasureThreads(threads, [&](size_t thread) {
+                for(size_t i = 0; i < lookups; i++)
+                    bench::DoNotOptimize(&nage::Get<nage::ListGenerator>((i + thread) % keys));
+            });
+            bench::Report("handler/get/" + std::string(reload ? "reload/" : "") + std::to_string(threads) + "-threads", (double) lookups * threads, seconds);
+        }
+
+        done = true;
+        if(writer.joinable())
+            writer.join();
+    }
+
+    nage::Free();
+    return 0;
+}
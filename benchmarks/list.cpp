@@ -0,0 +1,36 @@
+#include "bench.hpp"
+
+// Compares loading a 1M-line list with AddFromFile() and AddFromMappedFile().
+
+int main() {
+    const size_t lines = 1000000;
+    const std::string fileName = "bin/list-1m.txt";
+
+    {
+        nage::ListGenerator words("data/lists/english-words.txt");
+        std::ofstream file(fileName);
+        for(size_t i = 0; i < lines; i++)
+            file << words.At(i % words.Size()) << i / words.Size() << '\n';
+    }
+
+    nage::ListGenerator copied, mapped;
+    double seconds = bench::Measure([&]() { copied.AddFromFile(fileName); });
+    bench::Report("list/load/getline", lines, seconds);
+    printf("%-40s %12.1f ms\n", "", seconds * 1e3);
+
+    seconds = bench::Measure([&]() { mapped.AddFromMappedFile(fileName); });
+    bench::Report("list/load/mmap", lines, seconds);
+    printf("%-40s %12.1f ms\n", "", seconds * 1e3);
+
+    const size_t count = 1000000;
+    for(auto [name, generator] : {std::make_pair("getline", &copied), std::make_pair("mmap", &mapped)}) {
+        seconds = bench::Measure([&]() {
+            nage::NameTable names;
+            generator->GenerateN(count, names);
+            bench::DoNotOptimize(names.Data().data());
+        });
+        bench::Report(std::string("list/generate-n/") + name, count, seconds);
+    }
+
+    return 0;
+}
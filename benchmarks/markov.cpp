@@ -0,0 +1,38 @@
+#include "bench.hpp"
+
+// Size and generation speed of Markov chains of order 5 to 7, without smoothing, with
+// rare contexts pruned and with interpolated absolute discounting.
+
+int main() {
+    const std::pair<const char*, const char*> files[] = {
+        {"names", "data/lists/us-names.txt"},
+        {"words", "data/lists/english-words.txt"}
+    };
+    const std::pair<const char*, nage::MarkovSmoothing> smoothings[] = {
+        {"plain", {1, 0}},
+        {"pruned", {3, 0}},
+        {"discounted", {2, 0.75}}
+    };
+
+    for(auto& [fileName, path] : files) {
+        for(int order = 5; order <= 7; order++) {
+            for(auto& [smoothingName, smoothing] : smoothings) {
+                nage::MarkovChainGenerator markov(order);
+                markov.SetSmoothing(smoothing);
+                markov.Compute(path);
+                std::string name = std::string("markov/") + fileName + "/order-" + std::to_string(order) + "/" + smoothingName;
+
+                std::string buffer;
+                bench::Run(name, [&](size_t iterations) {
+                    for(size_t i = 0; i < iterations; i++) {
+                        markov.GenerateInto(buffer);
+                        bench::DoNotOptimize(buffer.data());
+                    }
+                });
+                printf("%-44s %12.1f KiB\n", "", markov.MemoryUsage() / 1024.0);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,41 @@
+#include "bench.hpp"
+
+// Generates a large batch on 1 to N cores and checks that the output is identical
+// whatever the number of threads.
+
+uint64_t Checksum(const nage::NameTable& names) {
+    uint64_t hash = 1469598103934665603ULL;
+    for(char c : names.Data())
+        hash = (hash ^ (unsigned char) c) * 1099511628211ULL;
+    return hash ^ names.Size();
+}
+
+int main() {
+    const size_t count = 2000000;
+    const uint64_t seed = 42;
+
+    nage::MarkovChainGenerator markov(3);
+    markov.Compute("data/lists/english-words.txt");
+    nage::PreparedGenerator<nage::MarkovChainGenerator> prepared = markov.Prepare<nage::MarkovChainGenerator>()
+        .Filter([](const std::string& name) { return name.size() > 3; });
+
+    uint64_t expected = 0;
+    for(size_t threads = 1; threads <= bench::MaxThreads(); threads *= 2) {
+        nage::ThreadPool pool(threads - 1);
+        nage::NameTable names;
+        double seconds = bench::Measure([&]() {
+            prepared.GetParallel(count, names, seed, pool);
+        });
+        bench::Report("parallel/markov/" + std::to_string(threads) + "-threads", count, seconds);
+
+        uint64_t checksum = Checksum(names);
+        if(expected == 0)
+            expected = checksum;
+        if(checksum != expected || names.Size() != count) {
+            printf("output differs with %zu threads\n", threads);
+            return 1;
+        }
+    }
+
+    return 0;
+}
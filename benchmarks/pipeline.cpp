@@ -0,0 +1,69 @@
+#include "bench.hpp"
+
+// Type-erased PreparedGenerator against the statically composed Pipeline, with the same
+// filters and modifiers, and the cost of building each of them.
+
+int main() {
+    nage::ListGenerator list("data/lists/english-words.txt");
+    nage::MarkovChainGenerator markov(3);
+    markov.Compute("data/lists/english-words.txt");
+
+    auto isLong = [](std::string_view name) { return name.size() > 4; };
+    auto hasNoQ = [](std::string_view name) { return name.find('q') == std::string_view::npos; };
+    auto isAscii = [](std::string_view name) {
+        for(char c : name)
+            if((unsigned char) c >= 0x80)
+                return false;
+        return true;
+    };
+    auto capitalize = [](std::string& name) { name[0] = toupper(name[0]); };
+
+    auto prepared = list.Prepare<nage::ListGenerator>().Filter(isLong).Filter(hasNoQ).Filter(isAscii).Edit(capitalize);
+    auto pipeline = list.Pipe<nage::ListGenerator>().Filter(isLong).Filter(hasNoQ).Filter(isAscii).Edit(capitalize);
+    std::string name;
+    bench::Run("list/prepared/try-get", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++) {
+            prepared.TryGet(name);
+            bench::DoNotOptimize(name.data());
+        }
+    });
+    bench::Run("list/pipeline/try-get", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++) {
+            pipeline.TryGet(name);
+            bench::DoNotOptimize(name.data());
+        }
+    });
+
+    auto preparedMarkov = markov.Prepare<nage::MarkovChainGenerator>().Filter(isLong).Filter(hasNoQ).Filter(isAscii).Edit(capitalize);
+    auto pipelineMarkov = markov.Pipe<nage::MarkovChainGenerator>().Filter(isLong).Filter(hasNoQ).Filter(isAscii).Edit(capitalize);
+    bench::Run("markov/prepared/try-get", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++) {
+            preparedMarkov.TryGet(name);
+            bench::DoNotOptimize(name.data());
+        }
+    });
+    bench::Run("markov/pipeline/try-get", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++) {
+            pipelineMarkov.TryGet(name);
+            bench::DoNotOptimize(name.data());
+        }
+    });
+
+    // Building: every step of a PreparedGenerator used to copy all the previous ones.
+    bench::Run("build/prepared", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++) {
+            auto built = list.Prepare<nage::ListGenerator>().Filter(isLong).Filter(hasNoQ).Filter(isAscii)
+                .Filter(isLong).Filter(hasNoQ).Filter(isAscii).Edit(capitalize).Limit(100);
+            bench::DoNotOptimize(built);
+        }
+    }, "pipelines");
+    bench::Run("build/pipeline", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++) {
+            auto built = list.Pipe<nage::ListGenerator>().Filter(isLong).Filter(hasNoQ).Filter(isAscii)
+                .Filter(isLong).Filter(hasNoQ).Filter(isAscii).Edit(capitalize).Limit(100);
+            bench::DoNotOptimize(built);
+        }
+    }, "pipelines");
+
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include "bench.hpp"
+
+// Startup cost of template files: 200 generated files of 50 templates of 40 values each,
+// loaded one by one, then at once on 1 to MaxThreads() threads. Then the startup of a
+// handler holding lists, Markov chains and templates: built from the sources and caches,
+// then loaded from an image with and without verifying its contents.
+
+int main() {
+    const size_t files = 200;
+    std::vector<std::string> fileNames;
+    {
+        nage::ListGenerator words("data/lists/english-words.txt");
+        std::filesystem::create_directories("bin/templates");
+        for(size_t i = 0; i < files; i++) {
+            fileNames.push_back("bin/templates/culture-" + std::to_string(i) + ".txt");
+            std::ofstream file(fileNames.back());
+            for(size_t k = 0; k < 50; k++) {
+                file << "k" << i << "_" << k << "=";
+                for(size_t v = 0; v < 40; v++) {
+                    file << words.At((i * 7919 + k * 104729 + v * 31) % words.Size());
+                    if(v % 7 == 3)
+                        file << ":2";
+                    file << (v + 1 == 40 ? ";\n\n" : v % 10 == 9 ? ",\n" : ",");
+                }
+            }
+        }
+    }
+
+    bench::Run("template/load/rinkworks", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++) {
+            nage::TemplateGenerator generator("data/templates/rinkworks.txt");
+            bench::DoNotOptimize(&generator);
+        }
+    }, "files");
+
+    bench::Run("template/load/one-by-one", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++) {
+            nage::TemplateGenerator generator(fileNames[i % files]);
+            bench::DoNotOptimize(&generator);
+        }
+    }, "files");
+
+    for(size_t threads = 1; threads <= bench::MaxThreads(); threads *= 2) {
+        nage::ThreadPool pool(threads - 1);
+        bench::Run("template/load/" + std::to_string(files) + "-files/" + std::to_string(threads) + "-threads", [&](size_t iterations) {
+            for(size_t i = 0; i < iterations; i += files) {
+                nage::TemplateGenerator generator;
+                generator.LoadTemplates(fileNames, pool);
+                bench::DoNotOptimize(&generator);
+            }
+        }, "files");
+    }
+
+    nage::Init();
+    auto build = [&]() {
+        nage::Put(0, nage::Make<nage::ListGenerator>("data/lists/english-words.txt"));
+        auto names = nage::Make<nage::ListGenerator>();
+        names->AddFromMappedFile("data/lists/us-names.txt");
+        nage::Put(1, std::move(names));
+        for(int order = 3; order <= 5; order++) {
+            auto markov = nage::Make<nage::MarkovChainGenerator>(order);
+            markov->LoadCacheOrCompute("bin/caches/startup-" + std::to_string(order) + ".bin", "data/lists/english-words.txt");
+            nage::Put(order, std::move(markov));
+        }
+        nage::Put(6, nage::Make<nage::TemplateGenerator>("data/templates/rinkworks.txt"));
+        auto cultures = nage::Make<nage::TemplateGenerator>();
+        cultures->LoadTemplates(fileNames);
+        nage::Put(7, std::move(cultures));
+    };
+    build();
+    nage::SaveImage("bin/startup.img");
+    printf("%-44s %12.1f KiB\n", "handler/image", std::filesystem::file_size("bin/startup.img") / 1024.0);
+
+    bench::Run("handler/startup/sources-and-caches", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++)
+            build();
+    }, "startups");
+    bench::Run("handler/startup/image", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++)
+            nage::LoadImage("bin/startup.img");
+    }, "startups");
+    bench::Run("handler/startup/image-verified", [&](size_t iterations) {
+        for(size_t i = 0; i < iterations; i++)
+            nage::LoadImage("bin/startup.img", true);
+    }, "startups");
+
+    // Verifying reads the arrays in place: it must not copy them out of the mapping.
+    bench::Measure([&]() { nage::LoadImage("bin/startup.img"); });
+    uint64_t allocations = bench::g_LastSample.allocations;
+    bench::Measure([&]() { nage::LoadImage("bin/startup.img", true); });
+    if(bench::g_LastSample.allocations != allocations) {
+        printf("verified image load copies arrays (%llu allocations instead of %llu)\n",
+            (unsigned long long) bench::g_LastSample.allocations, (unsigned long long) allocations);
+        return 1;
+    }
+    nage::Free();
+
+    return 0;
+}
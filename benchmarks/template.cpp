@@ -0,0 +1,46 @@
+#include "bench.hpp"
+
+// Compares reparsing a template expression on every call with evaluating it once compiled.
+
+int main() {
+    const size_t count = 200000;
+
+    nage::TemplateGenerator generator("data/templates/rinkworks.txt");
+    std::map<std::string, std::string> templates = {
+        {"japanese", "(aka|aki|bashi|gawa|kawa|furu|fuku|fuji|hana|hara|haru|hashi|hira|hon|hoshi|ichi|iwa|kami|kawa|ki|kita|kuchi|kuro|marui|matsu|miya|mori|moto|mura|nabe|naka|nishi|no|da|ta|o|oo|oka|saka|saki|sawa|shita|shima|i|suzu|taka|take|to|toku|toyo|ue|wa|wara|wata|yama|yoshi|kei|ko|zawa|zen|sen|ao|gin|kin|ken|shiro|zaki|yuki|asa)(||||||||||bashi|gawa|kawa|furu|fuku|fuji|hana|hara|haru|hashi|hira|hon|hoshi|chi|wa|ka|kami|kawa|ki|kita|kuchi|kuro|marui|matsu|miya|mori|moto|mura|nabe|naka|nishi|no|da|ta|o|oo|oka|saka|saki|sawa|shita|shima|suzu|taka|take|to|toku|toyo|ue|wa|wara|wata|yama|yoshi|kei|ko|zawa|zen|sen|ao|gin|kin|ken|shiro|zaki|yuki|sa)"},
+        {"chinese", "(zh|x|q|sh|h)(ao|ian|uo|ou|ia)(|(l|w|c|p|b|m)(ao|ian|uo|ou|ia)(|n)|-(l|w|c|p|b|m)(ao|ian|uo|ou|ia)(|(d|j|q|l)(a|ai|iu|ao|i)))"},
+        {"old-latin-place", "sv(nia|lia|cia|sia)"},
+    };
+
+    for(auto& [name, expr] : templates) {
+        double seconds = bench::Measure([&]() {
+            for(size_t i = 0; i < count; i++) {
+                std::string copy = expr;
+                bench::DoNotOptimize(generator.Evaluate(copy));
+            }
+        });
+        bench::Report("template/" + name + "/evaluate", count, seconds);
+
+        seconds = bench::Measure([&]() {
+            for(size_t i = 0; i < count; i++)
+                bench::DoNotOptimize(generator.Generate(expr));
+        });
+        bench::Report("template/" + name + "/generate-expr", count, seconds);
+
+        nage::CompiledTemplate compiled = generator.Compile(expr);
+        seconds = bench::Measure([&]() {
+            for(size_t i = 0; i < count; i++)
+                bench::DoNotOptimize(generator.Generate(compiled));
+        });
+        bench::Report("template/" + name + "/generate-compiled", count, seconds);
+
+        seconds = bench::Measure([&]() {
+            nage::NameTable names;
+            generator.GenerateN(compiled, count, names);
+            bench::DoNotOptimize(names.Data().data());
+        });
+        bench::Report("template/" + name + "/generate-n-compiled", count, seconds);
+    }
+
+    return 0;
+}
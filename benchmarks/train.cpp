@@ -0,0 +1,25 @@
+#include "bench.hpp"
+
+// Trains an order 3 chain on a 2M-line corpus with 1 to MaxThreads() threads.
+
+int main() {
+    const size_t lines = 2000000;
+    const std::string fileName = "bin/corpus-2m.txt";
+
+    {
+        nage::ListGenerator words("data/lists/english-words.txt");
+        std::ofstream file(fileName);
+        for(size_t i = 0; i < lines; i++)
+            file << words.At(i % words.Size()) << words.At(i * 7919 % words.Size()) << '\n';
+    }
+
+    for(size_t threads = 1; threads <= bench::MaxThreads(); threads *= 2) {
+        nage::ThreadPool pool(threads - 1);
+        nage::MarkovChainGenerator markov(3);
+        double seconds = bench::Measure([&]() { markov.Compute(fileName, pool); });
+        bench::Report("markov/compute/" + std::to_string(threads) + "-threads", lines, seconds);
+        printf("%-40s %12.1f ms\n", "", seconds * 1e3);
+    }
+
+    return 0;
+}
@@ -0,0 +1,68 @@
+#include "bench.hpp"
+
+#include <set>
+
+// Unique Markov names through a std::set filter and through PreparedGenerator::Unique(),
+// then unique draws from a list, and every name of a template drawn at random until a new
+// one comes against ranks visited in a random order.
+
+int main() {
+    const size_t count = 200000;
+    nage::MarkovChainGenerator markov(3);
+    markov.Compute("data/lists/english-words.txt");
+
+    std::set<std::string> seen;
+    nage::PreparedGenerator<nage::MarkovChainGenerator> filtered = markov.Prepare<nage::MarkovChainGenerator>()
+        .Filter([&](const std::string& name) { return seen.insert(name).second; });
+    nage::NameTable names;
+    double seconds = bench::Measure([&]() { filtered.GetN(count, names); });
+    bench::Report("markov/unique/std-set", names.Size(), seconds);
+
+    nage::FingerprintSet memory;
+    nage::PreparedGenerator<nage::MarkovChainGenerator> unique = markov.Prepare<nage::MarkovChainGenerator>()
+        .Unique();
+    names.Clear();
+    seconds = bench::Measure([&]() { unique.GetN(count, names); });
+    bench::Report("markov/unique/fingerprints", names.Size(), seconds);
+    for(size_t i = 0; i < names.Size(); i++)
+        memory.Insert(names[i]);
+    printf("%-40s %12.1f MB per million names\n", "", (double) memory.Memory() / memory.Size());
+
+    nage::ListGenerator list;
+    list.AddFromMappedFile("data/lists/english-words.txt");
+    list.SetUnique(true);
+    names.Clear();
+    seconds = bench::Measure([&]() { list.GenerateN(list.Size(), names); });
+    bench::Report("list/unique/generate-n", names.Size(), seconds);
+
+    nage::TemplateGenerator generator("data/templates/rinkworks.txt");
+    nage::CompiledTemplate compiled = generator.Compile("(zh|x|q|sh|h)(ao|ian|uo|ou|ia)(|(l|w|c|p|b|m)(ao|ian|uo|ou|ia)(|n)|-(l|w|c|p|b|m)(ao|ian|uo|ou|ia)(|(d|j|q|l)(a|ai|iu|ao|i)))");
+    std::string name;
+    nage::FingerprintSet drawn;
+    names.Clear();
+    seconds = bench::Measure([&]() {
+        // Some names have two derivations, stop at the first name missing after many draws.
+        for(size_t misses = 0; misses < 100000;) {
+            generator.GenerateUniformInto(compiled, name);
+            if(drawn.Insert(name)) {
+                names.Append(name);
+                misses = 0;
+            }
+            else
+                misses++;
+        }
+    });
+    bench::Report("template/unique/rejection", names.Size(), seconds);
+
+    nage::Permutation order(compiled.Cardinality(), 42);
+    names.Clear();
+    seconds = bench::Measure([&]() {
+        for(uint64_t i = 0; i < order.Size(); i++) {
+            generator.GenerateAt(compiled, order[i], name);
+            names.Append(name);
+        }
+    });
+    bench::Report("template/unique/permutation", names.Size(), seconds);
+
+    return 0;
+}
@@ -26,7 +26,7 @@ public:
         return "";
     }
     virtual std::string Generate() override {
-        return Generate((Gender)(rand()%2));
+        return Generate((Gender) GetRandom().NextBelow(2));
     }
 private:
     std::unique_ptr<nage::ListGenerator> m_MaleList;
@@ -34,8 +34,6 @@ private:
 };
 
 int main() {
-    srand(time(NULL));
-
     // Initialize nage (create context, prepare handler)
     nage::Init();
 
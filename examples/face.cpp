@@ -1,8 +1,6 @@
 #include "../nage.hpp"
 
 int main() {
-    srand(time(NULL));
-
     // Initialize nage (create context, prepare handler)
     nage::Init();
 
@@ -5,6 +5,11 @@ public:
     CityNameGenerator() {
         m_MarkovGenerator = nage::Make<nage::MarkovChainGenerator>(3);
         m_MarkovGenerator->LoadCacheOrCompute("data/caches/markov-cities.bin", "data/lists/german-cities.txt");
+
+        // Sample names of exactly 8 characters directly instead of filtering them
+        // nage::MarkovConstraints constraints;
+        // constraints.minLength = constraints.maxLength = 8;
+        // m_MarkovGenerator->SetConstraints(constraints);
     }
 
     virtual std::string Generate() override {
@@ -15,8 +20,6 @@ private:
 };
 
 int main() {
-    srand(time(NULL));
-
     // Initialize nage (create context, prepare handler)
     nage::Init();
 
@@ -1,8 +1,6 @@
 #include "../nage.hpp"
 
 int main() {
-    srand(time(NULL));
-
     // Initialize nage (create context, prepare handler)
     nage::Init();
 
@@ -23,6 +21,16 @@ int main() {
         printf("\n");
     }
 
+    // Count the names of a template and list a few of them without repeats
+    nage::CompiledTemplate compiled = generator->Compile(templates["chinese"]);
+    nage::Permutation order(compiled.Cardinality(), 42);
+    std::string name;
+    printf("chinese (%llu names):\n", (unsigned long long) compiled.Cardinality());
+    for(uint64_t i = 0; i < 5; i++) {
+        generator->GenerateAt(compiled, order[i], name);
+        printf("  - %s\n", name.c_str());
+    }
+
     nage::Free();
     return 0;
 }
\ No newline at end of file
@@ -28,11 +28,54 @@
 #include <limits.h>
 #include <string.h>
 #include <filesystem>
+#include <algorithm>
+#include <random>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdexcept>
+#include <string_view>
+#include <chrono>
+#include <array>
+#include <future>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <typeinfo>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+    #define NAGE_MMAP
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define NAGE_SSE2
+#endif
 
 /***********************************************************
 *                    MACROS/DEFINES                        *
 ***********************************************************/
 
+// Define NAGE_METRICS before including nage to instrument the generators, see Metrics.
+// Without it the instrumentation compiles to nothing.
+#ifdef NAGE_METRICS
+    #define NAGE_METRIC(generator, counter, value) (generator)->RecordMetric(nage::Metrics::counter, value)
+    #define NAGE_METRICS_SCOPE(names, buffer) nage::MetricScope nageMetricScope(this, names, buffer)
+    #define NAGE_METRICS_DEPTH() nage::DepthScope nageDepthScope
+#else
+    #define NAGE_METRIC(generator, counter, value) ((void) 0)
+    #define NAGE_METRICS_SCOPE(names, buffer) ((void) 0)
+    #define NAGE_METRICS_DEPTH() ((void) 0)
+#endif
+
 namespace nage {
 
     /***********************************************************
@@ -40,13 +83,438 @@ namespace nage {
     ***********************************************************/
 
     struct Handler;
+    class Random;
+    class ScopedRandom;
+    class WeightedSampler;
+    class NameTable;
+    class FingerprintSet;
+    class SymbolTable;
+    class ThreadPool;
+    class Executor;
+    template<typename T> class Array;
+    struct Metrics;
     class Generator;
     template<typename G> class PreparedGenerator;
+    template<typename G, typename... Steps> class Pipeline;
     class ListGenerator;
+    struct MarkovSmoothing;
+    struct MarkovModel;
+    struct MarkovConstraints;
+    class NGramCounter;
     class MarkovChainGenerator;
     class TemplateGenerator;
+    class CompiledTemplate;
+    class FaceGenerator;
+    class Image;
+
+    namespace file {
+        class MappedFile;
+
+        // Size, modification time and content hash of a file, used to detect stale caches.
+        struct Fingerprint {
+            uint64_t size = 0;
+            int64_t time = 0;
+            uint64_t hash = 0;
+        };
+    }
+
+    extern std::atomic<Handler*> g_Handler;
+
+    /***********************************************************
+    *                         RANDOM                           *
+    ***********************************************************/
+
+    // Random engine used by generators (xoshiro256**, seeded through splitmix64).
+    // Override Next() to plug in another engine. Instances are not synchronized: each
+    // thread uses its own engine unless one is explicitly injected into a generator.
+    class Random {
+        public:
+            using result_type = uint64_t;
+
+            Random();
+            Random(uint64_t seed);
+            virtual ~Random() = default;
+
+            void Seed(uint64_t seed);
+            virtual uint64_t Next();
+            double NextDouble();
+            uint64_t NextBelow(uint64_t bound);
+
+            uint64_t operator()();
+            static constexpr uint64_t min() { return 0; }
+            static constexpr uint64_t max() { return UINT64_MAX; }
+
+            static uint64_t SplitMix(uint64_t& state);
+        private:
+            uint64_t m_State[4];
+    };
+
+    // Makes `random` the engine of every generator used by the current thread
+    // until it goes out of scope.
+    class ScopedRandom {
+        public:
+            ScopedRandom(Random& random);
+            ~ScopedRandom();
+
+            ScopedRandom(const ScopedRandom&) = delete;
+            ScopedRandom& operator=(const ScopedRandom&) = delete;
+        private:
+            Random* m_Previous;
+    };
+
+    /***********************************************************
+    *                         ARRAY                            *
+    ***********************************************************/
+
+    // Contiguous array of trivially copyable elements which either owns them or borrows
+    // them from memory kept alive by `owner` (e.g. a mapped file). It follows the interface
+    // of std::vector, modifying a borrowed array first copies its elements.
+    template<typename T>
+    class Array {
+        public:
+            using value_type = T;
+
+            Array();
+
+            void Borrow(const T* data, size_t size, std::shared_ptr<const void> owner);
+            bool IsBorrowed() const;
+
+            size_t size() const;
+            bool empty() const;
+            const T* data() const;
+            T* data();
+            const T* begin() const;
+            const T* end() const;
+            T* begin();
+            T* end();
+            const T& back() const;
+            const T& operator[](size_t i) const;
+            T& operator[](size_t i);
+
+            void push_back(const T& value);
+            void append(const T* first, const T* last);
+            void assign(size_t count, const T& value);
+            void assign(const T* first, const T* last);
+            void resize(size_t count, const T& value = T());
+            void reserve(size_t count);
+            void clear();
+            void shrink_to_fit();
+        private:
+            void Own();
+
+            std::vector<T> m_Items;
+            const T* m_Borrowed;
+            size_t m_Size;
+            std::shared_ptr<const void> m_Owner;
+    };
+
+    /***********************************************************
+    *                        SAMPLING                          *
+    ***********************************************************/
+
+    // Draws indices from a discrete distribution in constant time using Vose's alias
+    // method. Cumulative sums are kept for the binary search fallback, which maps
+    // random values monotonically to indices.
+    class WeightedSampler {
+        public:
+            WeightedSampler();
+            WeightedSampler(const std::vector<double>& weights);
+
+            void Build(const double* weights, size_t count);
+            size_t Sample(double r) const;
+            size_t SampleCumulative(double r) const;
+            size_t Size() const;
+            bool Empty() const;
+
+            static void BuildAlias(const double* weights, size_t count, double* probabilities, uint32_t* aliases);
+            static size_t SampleAlias(const double* probabilities, const uint32_t* aliases, size_t count, double r);
+        private:
+            std::vector<double> m_Probabilities;
+            std::vector<uint32_t> m_Aliases;
+            std::vector<double> m_Cumulative;
+    };
+
+    // Seeded bijection of [0, size), to visit indices in a random order without storing
+    // them (e.g. the ranks of TemplateGenerator::GenerateAt for names that never repeat).
+    // An index goes through a 4-round Feistel network on the smallest number of bits
+    // covering `size` (halves differ by a bit for odd widths), again until it falls below
+    // `size`: less than twice on average.
+    class Permutation {
+        public:
+            Permutation(uint64_t size, uint64_t seed);
+
+            uint64_t Size() const;
+            uint64_t operator[](uint64_t index) const;
+        private:
+            uint64_t Encrypt(uint64_t x) const;
+
+            uint64_t m_Size;
+            uint32_t m_Bits;
+            uint64_t m_Keys[4];
+    };
+
+    /***********************************************************
+    *                       NAME TABLE                         *
+    ***********************************************************/
+
+    // Names stored back to back in a single buffer and addressed by their end offsets,
+    // filled by batch generation. Generators may also write straight into Buffer() and
+    // close the name with Push().
+    class NameTable {
+        public:
+            NameTable();
+
+            void Reserve(size_t count, size_t bytes);
+            void Clear();
+            void Append(std::string_view name);
+            void Push();
+            void Pop();
+
+            std::string& Buffer();
+            const std::string& Data() const;
+            size_t Size() const;
+            bool Empty() const;
+            std::string_view operator[](size_t i) const;
+            std::vector<std::string> ToVector() const;
+        private:
+            std::string m_Data;
+            std::vector<size_t> m_Ends;
+    };
+
+    /***********************************************************
+    *                    FINGERPRINT SET                       *
+    ***********************************************************/
+
+    // Set of names kept as 64-bit fingerprints, to tell whether a name was already
+    // produced. Two names sharing a fingerprint (about 1 chance in 2^64 per pair) are
+    // taken as equal. Slots are 8 bytes and the table is kept between 3/8 and 3/4 full,
+    // that is 10.7 to 21.3 MB per million names.
+    class FingerprintSet {
+        public:
+            FingerprintSet();
+
+            bool Insert(std::string_view str);
+            bool Contains(std::string_view str) const;
+            void Reserve(size_t count);
+            void Clear();
+            size_t Size() const;
+            size_t Memory() const;
+        private:
+            static uint64_t Fingerprint(std::string_view str);
+            void Rehash(size_t slots);
+
+            std::vector<uint64_t> m_Slots;
+            size_t m_Size;
+    };
+
+    /***********************************************************
+    *                      SYMBOL TABLE                        *
+    ***********************************************************/
+
+    // Interns short strings (template keys, UTF-8 characters) into dense ids starting at
+    // 0. Single ASCII characters are looked up directly, other keys through an
+    // open-addressing table over a pool holding all the keys back to back.
+    class SymbolTable {
+        public:
+            static constexpr uint32_t NONE = UINT32_MAX;
+
+            SymbolTable();
+
+            uint32_t Intern(std::string_view key);
+            uint32_t Find(std::string_view key) const;
+            std::string_view Key(uint32_t id) const;
+            size_t Size() const;
+            void Clear();
+        private:
+            uint32_t FindSlot(std::string_view key, uint64_t hash) const;
+
+            std::array<uint32_t, 128> m_Ascii;
+            std::vector<uint32_t> m_Slots;      // hash slot -> id
+            std::vector<uint32_t> m_Offsets;    // id -> start in m_Pool (size is ids + 1)
+            std::string m_Pool;
+    };
+
+    /***********************************************************
+    *                      THREAD POOL                         *
+    ***********************************************************/
+
+    // Fixed set of worker threads running submitted tasks in order. ForEach() spreads
+    // indices over the workers and the calling thread with work stealing; it must not be
+    // called from a task of the same pool.
+    class ThreadPool {
+        public:
+            ThreadPool(size_t threads = 0);
+            ~ThreadPool();
+
+            ThreadPool(const ThreadPool&) = delete;
+            ThreadPool& operator=(const ThreadPool&) = delete;
+
+            void Submit(std::function<void()> task);
+            void ForEach(size_t count, const std::function<void(size_t)>& func);
+            size_t Size() const;
+        private:
+            void Work();
+
+            std::vector<std::thread> m_Threads;
+            std::deque<std::function<void()>> m_Tasks;
+            std::mutex m_Mutex;
+            std::condition_variable m_Condition;
+            bool m_IsStopping;
+    };
+
+    /***********************************************************
+    *                        EXECUTOR                          *
+    ***********************************************************/
+
+    // Asynchronous front-end to the generators of the handler. Requests are queued per
+    // generator and its own workers take them in batches of up to MAX_BATCH: the
+    // generator is looked up once per batch and unseeded, unfiltered requests share a
+    // single GenerateN() call. At most `capacity` requests wait at once; Submit() blocks
+    // until there is room and TrySubmit() gives up instead. A generator is served by one
+    // worker at a time, so it may keep state (e.g. an engine set with SetRandom()) as
+    // long as nothing else uses it meanwhile. Pending requests are still served when the
+    // executor is destroyed. Callbacks run on the workers and must not throw.
+    class Executor {
+        public:
+            static constexpr size_t DEFAULT_CAPACITY = 4096;
+            static constexpr size_t MAX_BATCH = 256;
+            static constexpr size_t DEFAULT_ATTEMPTS = 10000;
+
+            struct Request {
+                uint32_t generator = 0;                 // key in the handler
+                size_t count = 1;
+                std::optional<uint64_t> seed;           // same names for the same seed
+                std::function<bool(const std::string&)> filter;
+                size_t maxAttempts = DEFAULT_ATTEMPTS;  // candidates per name with a filter
+            };
+
+            // Fewer names than requested when the filter exhausted its attempts, `error`
+            // is set when the request failed (e.g. unknown generator).
+            using Callback = std::function<void(NameTable& names, std::exception_ptr error)>;
+
+            Executor(size_t threads = 0, size_t capacity = DEFAULT_CAPACITY);
+            ~Executor();
+
+            Executor(const Executor&) = delete;
+            Executor& operator=(const Executor&) = delete;
+
+            std::future<NameTable> Submit(Request request);
+            void Submit(Request request, Callback callback);
+            bool TrySubmit(Request request, std::future<NameTable>& future);
+            bool TrySubmit(Request request, Callback callback);
+
+            size_t Pending() const;
+            size_t Size() const;
+        private:
+            struct Task {
+                Request request;
+                std::promise<NameTable> promise;
+                Callback callback;
+            };
+
+            bool Push(Task&& task, bool isBlocking);
+            void Work();
+            void Run(std::vector<Task>& batch);
+            void Generate(Generator& generator, const Request& request, NameTable& names);
+            static void Complete(Task& task, NameTable& names, std::exception_ptr error);
+
+            std::vector<std::thread> m_Threads;
+            std::unordered_map<uint32_t, std::deque<Task>> m_Queues;
+            std::deque<uint32_t> m_Ready;       // generators with queued requests, in turn
+            std::unordered_set<uint32_t> m_Running; // generators a worker is serving
+            size_t m_Pending;
+            size_t m_Capacity;
+            mutable std::mutex m_Mutex;
+            std::condition_variable m_Condition;
+            std::condition_variable m_NotFull;
+            bool m_IsStopping;
+    };
+
+    /***********************************************************
+    *                        METRICS                           *
+    ***********************************************************/
+
+    // Counters of a generator, summed over threads. Calls are timed one out of SAMPLING
+    // per thread. Allocations are growths of the output buffer of the generation calls.
+    struct Metrics {
+        static constexpr size_t LATENCY_BUCKETS = 32;   // bucket i: latencies in [2^i, 2^(i+1)) ns
+        static constexpr uint64_t SAMPLING = 16;
+
+        enum Counter : uint8_t {
+            CALLS,                  // Generate(), GenerateInto() and GenerateN() calls
+            NAMES,                  // names produced by these calls
+            ALLOCATIONS,
+            FALLBACKS,              // Markov: steps backing off to a shorter context or escaping
+            TEMPLATE_DEPTH,         // Template: sum over names of the deepest nesting
+            FILTER_EVALUATIONS,     // PreparedGenerator filters on the generator's names
+            FILTER_REJECTIONS,
+            COUNTERS
+        };
+
+        std::array<uint64_t, COUNTERS> counters = {};
+        std::array<uint64_t, LATENCY_BUCKETS> latencies = {};
+        uint64_t maxDepth = 0;      // Template: deepest nesting reached
+
+        static const char* Name(Counter counter);
+        Metrics& operator+=(const Metrics& other);
+    };
+
+    enum class MetricsFormat { TEXT, JSON };
+
+#ifdef NAGE_METRICS
+    // Per-thread shards of relaxed atomic counters: a thread always writes the same
+    // shard, so counters are only shared between threads beyond SHARDS of them. Copies
+    // of a generator start with empty counters.
+    class MetricCounters {
+        public:
+            static constexpr size_t SHARDS = 16;
+
+            MetricCounters();
+            MetricCounters(const MetricCounters&);
+            MetricCounters& operator=(const MetricCounters&);
+
+            void Add(Metrics::Counter counter, uint64_t value);
+            void AddLatency(uint64_t nanoseconds);
+            void Max(uint64_t depth);
+            Metrics Collect() const;
+        private:
+            struct alignas(64) Shard {
+                std::array<std::atomic<uint64_t>, Metrics::COUNTERS> counters{};
+                std::array<std::atomic<uint64_t>, Metrics::LATENCY_BUCKETS> latencies{};
+                std::atomic<uint64_t> maxDepth{0};
+            };
+
+            static size_t ShardIndex();
+
+            std::unique_ptr<Shard[]> m_Shards;
+    };
+
+    // Counts a generation call of `names` names when it goes out of scope, see
+    // NAGE_METRICS_SCOPE.
+    class MetricScope {
+        public:
+            MetricScope(const Generator* generator, uint64_t names, const std::string* buffer);
+            ~MetricScope();
+        private:
+            const Generator* m_Generator;
+            uint64_t m_Names;
+            const std::string* m_Buffer;
+            size_t m_Capacity;
+            std::chrono::steady_clock::time_point m_Start;
+            bool m_IsTimed;
+    };
+
+    // Tracks the nesting of template evaluation on the current thread.
+    struct DepthScope {
+        DepthScope();
+        ~DepthScope();
 
-    extern Handler* g_Handler;
+        static uint64_t TakeMaximum();
+
+        inline static thread_local uint32_t s_Depth = 0;
+        inline static thread_local uint32_t s_MaxDepth = 0;
+    };
+#endif
 
     /***********************************************************
     *                      GENERATORS                          *
@@ -55,28 +523,175 @@ namespace nage {
     class Generator {
         public:
             Generator();
-            ~Generator() = default;
+            virtual ~Generator() = default;
             
             template<typename G> PreparedGenerator<G> Prepare();
+            template<typename G> Pipeline<G> Pipe();
             virtual std::string Generate() = 0;
+            virtual void GenerateInto(std::string& out);
+            virtual void GenerateN(size_t count, NameTable& out);
+            virtual bool IsSequential() const;
+            std::string GenerateSeeded(uint64_t seed);
+
+            void SetRandom(Random* random);
+            Random& GetRandom();
+
+            Metrics GetMetrics() const;     // all zero without NAGE_METRICS
+#ifdef NAGE_METRICS
+            void RecordMetric(Metrics::Counter counter, uint64_t value) const;
+            void RecordLatency(uint64_t nanoseconds) const;
+            void RecordDepth(uint64_t depth) const;
+#endif
         private:
+            Random* m_Random;
+#ifdef NAGE_METRICS
+            mutable MetricCounters m_Metrics;
+#endif
     };
 
     // template<typename G, typename = typename std::enable_if<std::is_base_of<Generator, G>::value>::type>
     template<typename G>
     class PreparedGenerator {
         public:
+            static constexpr size_t SHARD_SIZE = 4096;
+            static constexpr size_t DEFAULT_ATTEMPTS = 10000;
+            static constexpr size_t LATENCY_BUCKETS = 32;       // bucket i: latencies in [2^i, 2^(i+1)) ns
+            static constexpr size_t ORDERED_FILTERS = 16;       // filters past this one keep their position
+            static constexpr uint64_t REORDER_INTERVAL = 1024;  // attempts between two filter reorderings
+            static constexpr uint64_t SAMPLING = 16;            // one attempt/call out of SAMPLING is timed
+
+            struct FilterStatistics {
+                uint64_t evaluations = 0;
+                uint64_t rejections = 0;
+                double averageTime = 0;     // nanoseconds per evaluation, sampled
+            };
+
+            struct Statistics {
+                uint64_t calls = 0;         // names requested
+                uint64_t failures = 0;      // names not generated within the budget
+                uint64_t attempts = 0;      // candidates generated
+                uint64_t duplicates = 0;    // candidates rejected as already produced
+                std::vector<FilterStatistics> filters;      // in insertion order
+                std::vector<size_t> order;                  // current evaluation order of filters
+                std::array<uint64_t, LATENCY_BUCKETS> latencies = {};  // sampled Get() calls, GetN() batches
+            };
+
             PreparedGenerator(G* generator);
 
-            PreparedGenerator Filter(std::function<bool(const std::string&)> pred);
-            PreparedGenerator Edit(std::function<std::string(std::string)> mod);
-            PreparedGenerator Generate(std::function<std::string(G*)> generate);
+            // Builder steps modify the generator and return it: copied when called on a
+            // variable, moved along a chain of calls on a temporary.
+            PreparedGenerator Filter(std::function<bool(const std::string&)> pred) &;
+            PreparedGenerator Filter(std::function<bool(const std::string&)> pred) &&;
+            template<typename F> PreparedGenerator Edit(F mod) &;
+            template<typename F> PreparedGenerator Edit(F mod) &&;
+            PreparedGenerator Generate(std::function<std::string(G*)> generate) &;
+            PreparedGenerator Generate(std::function<std::string(G*)> generate) &&;
+            PreparedGenerator Limit(size_t attempts, std::chrono::nanoseconds duration = std::chrono::nanoseconds::zero()) &;
+            PreparedGenerator Limit(size_t attempts, std::chrono::nanoseconds duration = std::chrono::nanoseconds::zero()) &&;
+            PreparedGenerator Unique(bool isUnique = true) &;
+            PreparedGenerator Unique(bool isUnique = true) &&;
+            void ResetUnique();
             std::string Get();
+            bool TryGet(std::string& token);
+            size_t GetN(size_t count, NameTable& out);
+            size_t GetParallel(size_t count, NameTable& out, uint64_t seed);
+            size_t GetParallel(size_t count, NameTable& out, uint64_t seed, ThreadPool& pool);
+
+            Statistics GetStatistics() const;
+            void ResetStatistics();
         private:
+            using Clock = std::chrono::steady_clock;
+
+            struct FilterCounters {
+                std::atomic<uint64_t> evaluations{0};
+                std::atomic<uint64_t> rejections{0};
+                std::atomic<uint64_t> timed{0};
+                std::atomic<uint64_t> nanoseconds{0};
+            };
+
+            // Shared by the copies made while building, replaced whenever a step is added.
+            struct Counters {
+                Counters(size_t filterCount);
+
+                std::atomic<uint64_t> calls{0};
+                std::atomic<uint64_t> failures{0};
+                std::atomic<uint64_t> attempts{0};
+                std::atomic<uint64_t> duplicates{0};
+                std::atomic<uint64_t> order{0};     // evaluation order, 4 bits per filter
+                std::array<std::atomic<uint64_t>, LATENCY_BUCKETS> latencies;
+                std::unique_ptr<FilterCounters[]> filters;
+            };
+
+            // Per-call counts, flushed into the shared counters once per call.
+            struct Tally {
+                uint64_t attempts = 0;
+                uint64_t duplicates = 0;
+                uint64_t sampling = 0;
+                uint32_t evaluations[ORDERED_FILTERS] = {};
+                uint32_t rejections[ORDERED_FILTERS] = {};
+            };
+
+            template<typename F> void AddModifier(F mod);
+            void SetLimit(size_t attempts, std::chrono::nanoseconds duration);
+            void SetUnique(bool isUnique);
+            bool IsValid(const std::string& token, Tally& tally) const;
+            bool IsNew(const std::string& token, Tally& tally);
+            void Flush(Tally& tally);
+            void Reorder();
+            void Record(Clock::time_point start);
+            void Reset();
+
             G* m_Generator;
             std::vector<std::function<bool(const std::string&)>> m_Filters;
-            std::vector<std::function<std::string(std::string)>> m_Modifiers;
+            std::vector<std::function<void(std::string&)>> m_Modifiers;
             std::function<std::string(G*)> m_Generate;
+            size_t m_MaxAttempts;
+            std::chrono::nanoseconds m_MaxDuration;
+            std::shared_ptr<Counters> m_Counters;
+            std::shared_ptr<FingerprintSet> m_Seen;
+    };
+
+    // Steps of a Pipeline, stored by value so that calls to them can be inlined.
+    template<typename F>
+    struct FilterStep {
+        F pred;
+
+        bool operator()(std::string& token);
+    };
+
+    template<typename F>
+    struct EditStep {
+        F mod;
+
+        bool operator()(std::string& token);
+    };
+
+    // Statically composed counterpart of PreparedGenerator: every filter and modifier is
+    // part of the type and the steps run in the order they were added, through a fold
+    // expression the compiler can inline entirely. It has neither statistics, uniqueness
+    // nor time budgets; PreparedGenerator remains the type-erased interface.
+    template<typename G, typename... Steps>
+    class Pipeline {
+        public:
+            Pipeline(G* generator);
+
+            template<typename F> Pipeline<G, Steps..., FilterStep<F>> Filter(F pred) &&;
+            template<typename F> Pipeline<G, Steps..., EditStep<F>> Edit(F mod) &&;
+            Pipeline Limit(size_t attempts) &&;
+
+            std::string Get();
+            bool TryGet(std::string& token);
+            size_t GetN(size_t count, NameTable& out);
+        private:
+            template<typename, typename...> friend class Pipeline;
+
+            Pipeline(G* generator, std::tuple<Steps...>&& steps, size_t maxAttempts);
+
+            template<size_t... I> bool IsValid(std::string& token, std::index_sequence<I...>);
+
+            G* m_Generator;
+            std::tuple<Steps...> m_Steps;
+            size_t m_MaxAttempts;
     };
 
     class ListGenerator : public Generator {
@@ -86,12 +701,185 @@ namespace nage {
             ListGenerator(const std::string& fileName);
 
             virtual std::string Generate() override;
+            virtual void GenerateInto(std::string& out) override;
+            virtual void GenerateN(size_t count, NameTable& out) override;
+            virtual bool IsSequential() const override;
 
             void Add(std::string token);
             void AddFromList(const std::vector<std::string>& tokens);
             void AddFromFile(const std::string& fileName);
+            void AddFromMappedFile(const std::string& fileName);
+
+            size_t Size() const;
+            std::string_view At(size_t i) const;
+
+            void SetUnique(bool isUnique);
+            bool IsUnique() const;
+            bool IsExhausted() const;
+            size_t Remaining() const;
+            void ResetUnique();
         private:
+            friend class Image;
+
+            void Track(size_t tokensBefore, size_t linesBefore);
+            size_t Draw(Random& random);
+
+            // Lines of a memory-mapped file (or of an image), addressed by their start offsets.
+            // The last offset marks the end of the file (plus one when it lacks a final newline).
+            struct MappedList {
+                std::shared_ptr<const void> owner;     // keeps `data` mapped
+                const char* data = nullptr;
+                Array<uint32_t> starts;
+            };
+
             std::vector<std::string> m_Tokens;
+            std::vector<MappedList> m_Lists;
+            size_t m_Size = 0;
+
+            // Unique mode: indices of distinct tokens, the first m_Remaining ones not drawn yet.
+            // Draws lock m_UniqueMutex, so that threads sharing the list never draw a token twice.
+            bool m_IsUnique = false;
+            std::vector<uint32_t> m_Unique;
+            size_t m_Remaining = 0;
+            FingerprintSet m_Distinct;
+            mutable std::mutex m_UniqueMutex;
+    };
+
+    // Smoothing of a MarkovChainGenerator. Contexts longer than one symbol seen fewer than
+    // `minCount` times are pruned, generation then backs off to the longest remaining suffix
+    // (a variable-order model). A `discount` in (0, 1) interpolates every context with its
+    // suffix: each successor count gives `discount` to an escape into the shorter context
+    // (absolute discounting, as in interpolated Kneser-Ney).
+    struct MarkovSmoothing {
+        uint32_t minCount = 1;
+        double discount = 0;
+    };
+
+    // Flat representation of a Markov chain: code points are interned into symbol ids and
+    // the successors of every context are stored contiguously as edges holding everything a
+    // generation step reads (alias table entry, symbol and next context). Only contexts
+    // reachable from the start are kept, e.g. without smoothing, the ones starting a name
+    // and the ones of `order` symbols. Their keys are not stored: the edges form a suffix
+    // automaton from which keys and the lookup table are rebuilt when the model is updated.
+    struct MarkovModel {
+        static constexpr uint32_t NONE = UINT32_MAX;
+        static constexpr uint32_t ESCAPE = UINT32_MAX;  // symbol of the edge to the back-off context
+
+        struct Edge {
+            double probability;             // alias table probability
+            uint32_t alias;                 // alias table entry, relative to the context
+            uint32_t symbol;                // successor symbol id
+            uint32_t next;                  // context reached after picking this successor
+            uint32_t count;                 // occurrences in the corpus
+        };
+
+        int order = 0;
+        uint32_t start = NONE;              // context made of the 'Start of Text' symbol
+        uint32_t end = NONE;                // symbol id of 'End of Text'
+        MarkovSmoothing smoothing;
+        Array<uint32_t> symbols;            // symbol id -> code point
+        Array<uint8_t> lengths;             // context -> number of symbols
+        Array<uint32_t> offsets;            // context -> first edge (size is contexts + 1)
+        Array<Edge> edges;                  // successors of every context, then its escape
+        Array<uint32_t> pruned;             // NGramCounter entries of the counts the model lacks
+        Array<uint32_t> contexts;           // index: `order` symbol ids per context
+        Array<uint32_t> table;              // index: hash slot -> context
+
+        void Clear();
+        void ClearIndex();
+        bool Empty() const;
+        bool IsIndexed() const;
+        bool IsConsistent(bool isVerified = true) const;
+        size_t ContextCount() const;
+        size_t MemoryUsage() const;
+        uint32_t Find(const uint32_t* ids, size_t length) const;
+        uint32_t FindLongestSuffix(const uint32_t* ids, size_t length) const;
+        uint32_t FindEdge(uint32_t context, uint32_t symbol) const;
+        uint32_t FindNext(uint32_t context, uint32_t level, uint32_t edge) const;
+        double GetTotal(uint32_t context) const;
+        void BuildIndex();
+        void BuildTable();
+        void BuildTransitions();
+        void BuildAliases();
+        void BuildAliases(uint32_t context);
+        void RemoveUnreachable();
+
+        bool Save(const std::string& fileName, const file::Fingerprint& source, uint64_t* checksum = nullptr) const;
+        bool Load(const std::string& fileName, file::Fingerprint& source, uint64_t* checksum = nullptr, bool isVerified = false);
+
+        static uint64_t Hash(const uint32_t* ids, size_t length);
+
+        // Cache file: header, section table then the arrays, each aligned on 16 bytes so
+        // that they can be used in place from a mapped file. The checksum covers
+        // everything after the header, it is only checked by verified loads.
+        static constexpr char MAGIC[8] = {'N', 'A', 'G', 'E', 'M', 'K', 'V', '\0'};
+        static constexpr uint32_t VERSION = 4;
+        static constexpr uint32_t ENDIANNESS = 0x01020304;
+
+        struct Header {
+            char magic[8];
+            uint32_t version;
+            uint32_t endianness;
+            uint32_t order;
+            uint32_t start;
+            uint32_t end;
+            uint32_t sectionCount;
+            uint32_t minCount;
+            uint32_t reserved;
+            double discount;
+            uint64_t sourceSize;
+            int64_t sourceTime;
+            uint64_t sourceHash;
+            uint64_t payloadSize;
+            uint64_t checksum;
+        };
+
+        struct Section {
+            uint32_t id;
+            uint32_t elementSize;
+            uint64_t offset;
+            uint64_t count;
+        };
+    };
+
+    // Occurrences of (context, next code point) pairs, contexts being 1 to `order` code
+    // points. Entries are stored flat as [length, context (padded with 0), next, count].
+    class NGramCounter {
+        public:
+            NGramCounter(int order);
+
+            void AddLine(std::string_view line, int64_t count = 1);
+            void Add(const uint32_t* context, uint32_t length, uint32_t next, int64_t count);
+            uint32_t Count(const uint32_t* context, uint32_t length, uint32_t next);
+            void Merge(const NGramCounter& other);
+            void Clear();
+
+            int Order() const;
+            size_t Size() const;
+            size_t Stride() const;
+            const uint32_t* Entry(size_t i) const;
+            std::vector<uint32_t> Sort() const;
+        private:
+            uint32_t* Find(const uint32_t* key, bool isInserting);
+            void Grow();
+
+            int m_Order;
+            size_t m_Stride;
+            std::vector<uint32_t> m_Entries;
+            std::vector<uint32_t> m_Slots;
+            std::vector<uint32_t> m_Line;
+            std::vector<uint32_t> m_Key;
+    };
+
+    // Constraints on the names of a MarkovChainGenerator, lengths are in code points.
+    struct MarkovConstraints {
+        size_t minLength = 0;
+        size_t maxLength = 9;
+        std::string prefix;
+        std::string suffix;
+        std::string required;                           // characters which must all appear
+        std::string forbidden;                          // characters which must not appear
+        std::vector<std::string> forbiddenSubstrings;
     };
 
     class MarkovChainGenerator : public Generator {
@@ -100,13 +888,114 @@ namespace nage {
             MarkovChainGenerator(int order, const std::string& fileName);
 
             virtual std::string Generate() override;
+            virtual void GenerateInto(std::string& out) override;
+            virtual void GenerateN(size_t count, NameTable& out) override;
             
-            void Load(const std::string& fileName);
-            void Save(const std::string& fileName);
+            bool Load(const std::string& fileName, bool isVerified = false);
+            bool Save(const std::string& fileName);
             void Compute(const std::string& fileName);
-            void LoadCacheOrCompute(const std::string& cacheFileName, const std::string& fileName);
+            void Compute(const std::string& fileName, ThreadPool& pool);
+            void LoadCacheOrCompute(const std::string& cacheFileName, const std::string& fileName, bool isVerified = false);
+
+            void Add(std::string_view line);
+            void Remove(std::string_view line);
+            void Update(const std::vector<std::string>& added, const std::vector<std::string>& removed);
+            bool SaveUpdates(const std::string& cacheFileName);
+
+            void SetConstraints(const MarkovConstraints& constraints);
+            void ClearConstraints();
+            const MarkovConstraints& GetConstraints() const;
+            bool IsSatisfiable() const;
+
+            void SetSmoothing(const MarkovSmoothing& smoothing);
+            const MarkovSmoothing& GetSmoothing() const;
+            size_t MemoryUsage() const;
+
+            static constexpr size_t MAX_CONSTRAINED_LENGTH = 255;
+            static constexpr size_t MAX_REQUIRED = 16;
+            static constexpr size_t MAX_PATTERN_STATES = 256;
+            static constexpr size_t MAX_PLAN_WEIGHTS = (size_t) 1 << 24;   // 128 MiB of weights
+            static constexpr size_t COMPACTION_RATIO = 4;     // the log is compacted past 1/4 of the cache
         private:
-            std::map<std::string, std::map<std::string, double>> m_Probabilities;
+            friend class Image;
+
+            // Delta log written next to a cache ("<cache>.log"): lines added or removed and
+            // source list changes since the cache was saved, replayed by Load(). It is bound
+            // to the cache through the checksum of the latter.
+            static constexpr char LOG_MAGIC[8] = {'N', 'A', 'G', 'E', 'M', 'K', 'L', '\0'};
+            static constexpr uint32_t LOG_LINE = 0;
+            static constexpr uint32_t LOG_SOURCE = 1;
+
+            struct LogHeader {
+                char magic[8];
+                uint32_t version;
+                uint32_t reserved;
+                uint64_t base;
+            };
+
+            struct LogRecord {
+                uint32_t type;
+                uint32_t size;
+                int64_t count;
+                uint64_t checksum;
+            };
+
+            // Constrained sampling: a name is walked through the chain while an automaton
+            // tracks the suffix and forbidden substrings. `weights` holds, for every state
+            // (length, context, automaton state, required characters seen), the probability
+            // that the chain completes a name satisfying the constraints. Picking edges in
+            // proportion to probability * weight of the next state samples the chain
+            // conditioned on the constraints, so that no name is ever rejected. Weights are
+            // dense layers of one length each, from the prefix length to the maximum one.
+            struct Plan {
+                static constexpr uint8_t DEAD = 1;
+                static constexpr uint8_t SUFFIX = 2;
+
+                bool isActive = false;
+                std::string prefix;
+                uint32_t context = MarkovModel::NONE;   // state after the prefix
+                uint32_t length = 0;
+                uint32_t state = 0;
+                uint32_t mask = 0;
+                uint32_t fullMask = 0;
+                size_t minLength = 0;
+                size_t maxLength = 0;
+                size_t symbolCount = 0;
+                std::vector<uint32_t> transitions;      // automaton state * symbolCount + symbol -> state
+                std::vector<uint8_t> flags;             // automaton state -> DEAD | SUFFIX
+                std::vector<uint32_t> bits;             // symbol -> required character bit
+                size_t stateCount = 0;
+                size_t maskCount = 0;
+                std::vector<double> weights;            // length - `length` -> context -> state -> mask
+            };
+
+            void Compile(const NGramCounter& counter);
+            void Apply(const NGramCounter& added, const NGramCounter& removed);
+            void LoadCounts();
+            void RestoreCounts(NGramCounter& counts) const;
+            size_t ReadLog(const std::string& fileName, bool isReplaying);
+            bool AddSourceTail(const std::string& fileName);
+            void Generate(Random& random, std::string& str) const;
+            void GenerateConstrained(Random& random, std::string& str) const;
+            void BuildPlan();
+            void Weigh();
+            double GetWeight(uint32_t context, uint32_t length, uint32_t state, uint32_t mask) const;
+            double GetSuccessorWeight(uint32_t symbol, uint32_t next, uint32_t length, uint32_t state, uint32_t mask) const;
+            bool IsAccepted(uint32_t length, uint32_t state, uint32_t mask) const;
+            uint32_t FindSymbol(uint32_t codePoint) const;
+            template<typename F>
+            void ForEachSuccessor(uint32_t context, F&& func) const;
+
+            MarkovModel m_Model;
+            MarkovSmoothing m_Smoothing;
+            file::Fingerprint m_Source;
+            NGramCounter m_Counts;
+            bool m_HasCounts;
+            uint64_t m_Checksum;
+            std::vector<std::pair<int64_t, std::string>> m_Pending;
+            bool m_IsSourceChanged;
+            MarkovConstraints m_Constraints;
+            Plan m_Plan;
             int m_Order;
     };
 
@@ -116,27 +1005,283 @@ namespace nage {
             TemplateGenerator(const std::string& fileName);
 
             std::string Generate(std::string expr);
-            virtual std::string Generate() override; 
+            std::string Generate(const CompiledTemplate& compiled);
+            virtual std::string Generate() override;
+            virtual void GenerateInto(std::string& out) override;
+            virtual void GenerateN(size_t count, NameTable& out) override;
+            void GenerateInto(const CompiledTemplate& compiled, std::string& out);
+            void GenerateN(const CompiledTemplate& compiled, size_t count, NameTable& out);
+            void GenerateAt(const CompiledTemplate& compiled, uint64_t rank, std::string& out);
+            void GenerateUniformInto(const CompiledTemplate& compiled, std::string& out);
 
+            // Expression used by the calls without one (Generate(), GenerateN(), prepared
+            // generators, executors), compiled again when templates are loaded. They throw
+            // std::logic_error while there is none.
+            void SetTemplate(const std::string& expr);
+            const std::string& GetTemplate() const;
+
+            CompiledTemplate Compile(const std::string& expr) const;
             std::string Evaluate(std::string& expr, bool isLiteral = false);
             void LoadTemplates(const std::string& fileName);
+            void LoadTemplates(const std::vector<std::string>& fileNames);
+            void LoadTemplates(const std::vector<std::string>& fileNames, ThreadPool& pool);
+
+            // Values [first, first + count) of the value tables.
+            struct Template {
+                uint32_t first = 0;
+                uint32_t count = 0;
+            };
+        private:
+            friend class Image;
+
+            // Templates of one file, parsed apart from the generator so that files can be
+            // parsed in parallel, then merged in order. Values are relative to the file.
+            struct TemplateFile {
+                SymbolTable keys;
+                std::vector<Template> templates;    // key id -> template
+                std::string pool;
+                std::vector<uint32_t> offsets;
+                std::vector<double> weights;        // weights, then alias table probabilities
+                std::vector<uint32_t> aliases;
+            };
+
+            uint32_t Compile(CompiledTemplate& compiled, const std::string& expr, size_t& i, bool isLiteral) const;
+            void Evaluate(const CompiledTemplate& compiled, uint32_t node, Random& random, std::string& str) const;
+            void EvaluateAt(const CompiledTemplate& compiled, uint32_t node, uint64_t rank, std::string& str) const;
+            void EvaluateUniform(const CompiledTemplate& compiled, uint32_t node, Random& random, std::string& str) const;
+            void Count(CompiledTemplate& compiled) const;
+
+            const Template* FindTemplate(std::string_view key) const;
+            std::string_view Value(uint32_t value) const;
+            std::string_view Sample(const Template& t, Random& random) const;
+            void ClearTemplates();
+            void MergeTemplates(TemplateFile& parsed);
+            static void ParseTemplates(std::string_view text, TemplateFile& parsed);
+            const CompiledTemplate& GetDefault() const;
+
+            SymbolTable m_Keys;
+            Array<Template> m_Templates;        // key id -> template
+            Array<char> m_Pool;                 // values back to back
+            Array<uint32_t> m_Offsets;          // value -> start in m_Pool (size is values + 1)
+            Array<double> m_Probabilities;      // value -> alias table probability
+            Array<uint32_t> m_Aliases;          // value -> alias, relative to the template
+            std::string m_Template;             // default expression, see SetTemplate()
+            std::unique_ptr<CompiledTemplate> m_Default;
+    };
+
+    // Template expression parsed once into a tree of nodes with its `<symbol>` references
+    // resolved, see TemplateGenerator::Compile(). It stays valid until the templates of
+    // the generator that compiled it are reloaded. Cardinality() is the number of names it
+    // can make: derivations, with repeated fixed texts of a choice and repeated values of a
+    // symbol counted once. Names made in different ways (e.g. `(a|ab)(b|)`) still count
+    // once per way.
+    class CompiledTemplate {
+        public:
+            CompiledTemplate();
+
+            bool Empty() const;
+            uint64_t Cardinality() const;
+        private:
+            friend class TemplateGenerator;
+
+            enum class Type : uint8_t { LITERAL, SYMBOL, SEQUENCE, CHOICE };
+
+            // LITERAL: characters [begin, begin + count) of the pool.
+            // SYMBOL: template `begin` of the symbols.
+            // SEQUENCE, CHOICE: children [begin, begin + count), alternatives of a choice are sequences.
+            struct Node {
+                Type type;
+                uint32_t begin;
+                uint32_t count;
+            };
+
+            std::vector<Node> m_Nodes;
+            std::vector<uint32_t> m_Children;
+            std::vector<const TemplateGenerator::Template*> m_Symbols;
+            std::string m_Pool;
+            uint32_t m_Root;
+
+            // Names of every node, saturated at UINT64_MAX. An alternative repeating the text
+            // of a former one of its choice counts 0 and symbols keep their distinct values.
+            std::vector<uint64_t> m_Counts;
+            std::vector<uint32_t> m_Values;         // distinct values of every symbol, back to back
+            std::vector<uint32_t> m_ValueStarts;    // symbol -> first in m_Values (size is symbols + 1)
+    };
+
+    // ASCII-art faces made of parts stacked in layers, one layer per part type in order of
+    // first appearance (e.g. STRUCT, then HAIR). Parts are compiled once into rows as wide
+    // as the face, each with a mask of its visible cells (spaces are transparent), so that
+    // a face is a blank canvas copy plus one masked blend per row of every picked part.
+    class FaceGenerator : public Generator {
+        public:
+            FaceGenerator();
+            FaceGenerator(const std::string& fileName);
+
+            virtual std::string Generate() override;
+            virtual void GenerateInto(std::string& out) override;
+            virtual void GenerateN(size_t count, NameTable& out) override;
+
+            void LoadParts(const std::string& fileName);
+            size_t Size() const;
+            size_t Width() const;
+            size_t Height() const;
         private:
-            std::map<std::string, std::vector<std::string>> m_Templates;
+            // Part syntax: `id=...; type=...; pos=row[,column]; str=<lines>;`
+            struct Part {
+                std::string id;
+                uint32_t row = 0;       // first canvas row covered
+                uint32_t column = 0;
+                uint32_t height = 0;
+                uint32_t first = 0;     // first compiled row
+                std::vector<std::string> lines;
+            };
+
+            struct Layer {
+                std::string type;
+                std::vector<uint32_t> parts;
+            };
+
+            void Compile();
+            void Compose(Random& random, char* canvas) const;
+
+            std::vector<Part> m_Parts;
+            std::vector<Layer> m_Layers;
+            std::string m_Glyphs;               // compiled rows, m_Width bytes each
+            std::string m_Masks;                // 0xFF where the glyph is visible
+            std::vector<uint8_t> m_IsOpaque;    // compiled row -> fully visible
+            std::string m_Blank;                // empty canvas, rows ended by '\n'
+            size_t m_Width;
+            size_t m_Height;
     };
 
     /***********************************************************
     *                        HANDLER                           *
     ***********************************************************/
 
+    // Registry of generators by id, safe to use from any number of threads.
+    // Writers publish a new immutable registry (copy-on-write) and bump the version,
+    // readers keep the last registry they saw in a thread-local cache and only take the
+    // lock when the version changed. A replaced generator stays alive for as long as
+    // a thread still holds a registry (or a pointer from Acquire) referencing it.
     struct Handler {
-        std::map<uint32_t, std::unique_ptr<Generator>> generators;
+        public:
+            using Registry = std::unordered_map<uint32_t, std::shared_ptr<Generator>>;
+
+            Handler();
+
+            void Put(uint32_t key, std::shared_ptr<Generator> generator);
+            bool Remove(uint32_t key);
+            void Clear();
+
+            Generator* Find(uint32_t key);
+            std::shared_ptr<Generator> Acquire(uint32_t key) const;
+            std::shared_ptr<const Registry> Snapshot() const;
+            uint64_t Version() const;
+
+            std::vector<std::pair<uint32_t, Metrics>> CollectMetrics() const;
+            std::string ExportMetrics(MetricsFormat format = MetricsFormat::TEXT) const;
+
+            bool SaveImage(const std::string& fileName, std::vector<uint32_t>* skipped = nullptr) const;
+            bool LoadImage(const std::string& fileName, bool isVerified = false);
+        private:
+            void Publish(std::shared_ptr<const Registry> registry);
+
+            inline static std::atomic<uint64_t> s_Instances;
+
+            uint64_t m_Id;
+            std::atomic<uint64_t> m_Version;
+            mutable std::mutex m_Mutex;
+            std::shared_ptr<const Registry> m_Registry;
+    };
+
+    // Snapshot of the generators of a handler in one relocatable file, so that processes
+    // start with a single mapping instead of reading lists, caches and templates. The file
+    // is mapped read-only and the generators borrow their arrays from it: processes loading
+    // the same image share its pages through the page cache, and a generator copies an
+    // array only when it is modified. Lists, Markov chains and templates are supported,
+    // other generators (and derived classes) are skipped; per-process settings (unique
+    // draws, constraints, default templates, random engines) are not saved. An image is
+    // trusted: unless it is verified, only its tables and the bounds of its arrays are
+    // checked on load.
+    class Image {
+        public:
+            // Header, entry table, section table then the arrays, each aligned on 16 bytes.
+            // `tableChecksum` covers the tables and is always checked, `checksum` covers
+            // everything after the header and is only checked on request.
+            static constexpr char MAGIC[8] = {'N', 'A', 'G', 'E', 'I', 'M', 'G', '\0'};
+            static constexpr uint32_t VERSION = 2;
+            static constexpr uint32_t ENDIANNESS = 0x01020304;
+
+            enum Type : uint32_t { LIST = 0, MARKOV = 1, TEMPLATE = 2 };
+
+            struct Header {
+                char magic[8];
+                uint32_t version;
+                uint32_t endianness;
+                uint32_t entryCount;
+                uint32_t sectionCount;
+                uint64_t payloadSize;
+                uint64_t tableChecksum;
+                uint64_t checksum;
+            };
+
+            // A generator and its sections [firstSection, firstSection + sectionCount).
+            // Markov chains also keep their order, states, smoothing and source list.
+            struct Entry {
+                uint32_t key;
+                uint32_t type;
+                uint32_t firstSection;
+                uint32_t sectionCount;
+                uint32_t order;
+                uint32_t start;
+                uint32_t end;
+                uint32_t minCount;
+                double discount;
+                uint64_t sourceSize;
+                int64_t sourceTime;
+                uint64_t sourceHash;
+            };
+
+            struct Section {
+                uint32_t id;            // index among the sections of its generator
+                uint32_t elementSize;
+                uint64_t offset;
+                uint64_t count;
+            };
+
+            static bool Save(const Handler::Registry& registry, const std::string& fileName, std::vector<uint32_t>* skipped = nullptr);
+            static bool Load(const std::string& fileName, Handler::Registry& registry, bool isVerified);
+        private:
+            struct Writer {
+                std::string data;
+                std::vector<Section> sections;
+                uint32_t first = 0;
+
+                void Add(const void* elements, size_t elementSize, size_t count);
+            };
+
+            struct Reader {
+                std::shared_ptr<file::MappedFile> mapping;
+                const Section* sections = nullptr;
+                const Entry* entry = nullptr;
+
+                template<typename T> bool Borrow(Array<T>& array, uint32_t id) const;
+            };
+
+            static bool SaveList(const ListGenerator& list, Writer& writer);
+            static bool SaveMarkov(const MarkovChainGenerator& markov, Writer& writer, Entry& entry);
+            static bool SaveTemplates(const TemplateGenerator& templates, Writer& writer);
+            static std::shared_ptr<Generator> LoadList(const Reader& reader, bool isVerified);
+            static std::shared_ptr<Generator> LoadMarkov(const Reader& reader, bool isVerified);
+            static std::shared_ptr<Generator> LoadTemplates(const Reader& reader, bool isVerified);
     };
 
     /***********************************************************
     *                    GLOBAL VARIABLES                      *
     ***********************************************************/
 
-    inline Handler* g_Handler;
+    inline std::atomic<Handler*> g_Handler;
+    inline thread_local Random* g_ScopedRandom;
 
     /***********************************************************
     *                   GLOBAL FUNCTIONS                       *
@@ -145,17 +1290,61 @@ namespace nage {
     void Init();
     void Free();
     Handler* GetHandler();
+    Random& GetRandom();
+    ThreadPool& GetThreadPool();
 
     template<typename T, typename... Args> std::unique_ptr<T> Make(Args&&... args);
     template<typename T> T& Get(uint32_t key);
+    template<typename T> std::shared_ptr<T> Acquire(uint32_t key);
     void Put(uint32_t key, std::unique_ptr<Generator> generator);
+    bool Remove(uint32_t key);
+    std::string ExportMetrics(MetricsFormat format = MetricsFormat::TEXT);
+    bool SaveImage(const std::string& fileName, std::vector<uint32_t>* skipped = nullptr);
+    bool LoadImage(const std::string& fileName, bool isVerified = false);
 
     namespace string {
         size_t CharLength(char ch);
         size_t StrLength(const std::string& str);
+        size_t AsciiLength(const char* str, size_t length);
+        bool IsValid(const char* str, size_t length);
+        uint32_t Decode(const char* str, size_t length, size_t& i);
+        void Decode(std::string_view str, std::vector<uint32_t>& codePoints);
+        void Encode(uint32_t codePoint, std::string& str);
     }
 
     namespace file {
+        // Read-only view of a whole file. It is memory-mapped when the platform allows it,
+        // so that processes mapping the same file share its pages through the page cache,
+        // and read into memory otherwise. Pages are read lazily, unless the file is opened
+        // as `isSequential` to be scanned once from start to end.
+        class MappedFile {
+            public:
+                MappedFile();
+                MappedFile(const std::string& fileName, bool isSequential = false);
+                ~MappedFile();
+
+                MappedFile(const MappedFile&) = delete;
+                MappedFile& operator=(const MappedFile&) = delete;
+
+                bool Open(const std::string& fileName, bool isSequential = false);
+                void Close();
+                bool IsOpen() const;
+                const char* Data() const;
+                size_t Size() const;
+                std::string_view View() const;
+            private:
+                const char* m_Data;
+                size_t m_Size;
+                bool m_IsOpen;
+                bool m_IsMapped;
+                std::vector<char> m_Buffer;
+        };
+
+        uint64_t Hash(const void* data, size_t size, uint64_t seed = 0);
+        bool GetFingerprint(const std::string& fileName, Fingerprint& fingerprint, bool withHash = true);
+        bool IsSameSource(const Fingerprint& cached, const std::string& fileName);
+        bool Replace(const std::string& fileName, std::initializer_list<std::string_view> parts);
+
         template <typename T> T Read(std::ifstream& file);
         template <typename T> T Read(std::ifstream& file, size_t length);
         template <typename T> void Write(std::ofstream& file, const T& value);
@@ -171,19 +1360,38 @@ namespace nage {
     ***********************************************************/
 
     inline void Init() {
-        if(g_Handler != NULL)
-            return;
-        g_Handler = new Handler();
+        // The handler is never deleted so that threads racing with Free() never
+        // dereference a dangling pointer, Free() only releases its generators.
+        static Handler handler;
+        Handler* expected = nullptr;
+        g_Handler.compare_exchange_strong(expected, &handler, std::memory_order_acq_rel);
     }
 
     inline void Free() {
-        if(g_Handler == NULL)
+        Handler* handler = g_Handler.exchange(nullptr, std::memory_order_acq_rel);
+        if(handler == nullptr)
             return;
-        delete g_Handler;
+        handler->Clear();
+        // Drop the registry cached by this thread right away, other threads drop theirs
+        // on their next lookup or when they exit.
+        handler->Find(0);
     }
 
     inline Handler* GetHandler() {
-        return g_Handler;
+        return g_Handler.load(std::memory_order_acquire);
+    }
+
+    inline Random& GetRandom() {
+        if(g_ScopedRandom != nullptr)
+            return *g_ScopedRandom;
+        static thread_local Random random;
+        return random;
+    }
+
+    inline ThreadPool& GetThreadPool() {
+        // The calling thread takes part in the work, hence one worker less than cores.
+        static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+        return pool;
     }
 
     template<typename T, typename... Args>
@@ -193,11 +1401,191 @@ namespace nage {
 
     template<typename T>
     inline T& Get(uint32_t key) {
-        return *(static_cast<T*>(g_Handler->generators.at(key).get()));
+        // The reference stays valid until this thread looks up a generator again after
+        // the key was replaced or removed, use Acquire() to hold it longer.
+        Handler* handler = GetHandler();
+        Generator* generator = (handler != nullptr) ? handler->Find(key) : nullptr;
+        if(generator == nullptr)
+            throw std::out_of_range("nage: no generator with key " + std::to_string(key));
+        return *(static_cast<T*>(generator));
+    }
+
+    template<typename T>
+    inline std::shared_ptr<T> Acquire(uint32_t key) {
+        Handler* handler = GetHandler();
+        return (handler != nullptr) ? std::static_pointer_cast<T>(handler->Acquire(key)) : nullptr;
     }
 
     inline void Put(uint32_t key, std::unique_ptr<Generator> generator) {
-        g_Handler->generators[key] = std::move(generator);
+        GetHandler()->Put(key, std::move(generator));
+    }
+
+    inline bool Remove(uint32_t key) {
+        Handler* handler = GetHandler();
+        return handler != nullptr && handler->Remove(key);
+    }
+
+    inline std::string ExportMetrics(MetricsFormat format) {
+        Handler* handler = GetHandler();
+        if(handler == nullptr)
+            return format == MetricsFormat::JSON ? "{\"generators\":[]}\n" : "";
+        return handler->ExportMetrics(format);
+    }
+
+    inline bool SaveImage(const std::string& fileName, std::vector<uint32_t>* skipped) {
+        Handler* handler = GetHandler();
+        return handler != nullptr && handler->SaveImage(fileName, skipped);
+    }
+
+    inline bool LoadImage(const std::string& fileName, bool isVerified) {
+        Handler* handler = GetHandler();
+        return handler != nullptr && handler->LoadImage(fileName, isVerified);
+    }
+
+    /***********************************************************
+    *                    HANDLER FUNCTIONS                     *
+    ***********************************************************/
+
+    inline Handler::Handler() {
+        m_Id = ++s_Instances;
+        m_Version = 0;
+        m_Registry = std::make_shared<const Registry>();
+    }
+
+    inline void Handler::Put(uint32_t key, std::shared_ptr<Generator> generator) {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        auto registry = std::make_shared<Registry>(*m_Registry);
+        (*registry)[key] = std::move(generator);
+        Publish(std::move(registry));
+    }
+
+    inline bool Handler::Remove(uint32_t key) {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if(m_Registry->count(key) == 0)
+            return false;
+        auto registry = std::make_shared<Registry>(*m_Registry);
+        registry->erase(key);
+        Publish(std::move(registry));
+        return true;
+    }
+
+    inline void Handler::Clear() {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        Publish(std::make_shared<const Registry>());
+    }
+
+    inline Generator* Handler::Find(uint32_t key) {
+        struct Cache {
+            uint64_t handler = 0;
+            uint64_t version = 0;
+            std::shared_ptr<const Registry> registry;
+        };
+        static thread_local Cache cache;
+
+        // The registry is at least as recent as the version read before taking it,
+        // a concurrent write only causes one more refresh on the next lookup.
+        uint64_t version = m_Version.load(std::memory_order_acquire);
+        if(cache.handler != m_Id || cache.version != version || !cache.registry) {
+            cache.registry = Snapshot();
+            cache.handler = m_Id;
+            cache.version = version;
+        }
+
+        auto it = cache.registry->find(key);
+        return (it != cache.registry->end()) ? it->second.get() : nullptr;
+    }
+
+    inline std::shared_ptr<Generator> Handler::Acquire(uint32_t key) const {
+        std::shared_ptr<const Registry> registry = Snapshot();
+        auto it = registry->find(key);
+        return (it != registry->end()) ? it->second : nullptr;
+    }
+
+    inline std::shared_ptr<const Handler::Registry> Handler::Snapshot() const {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return m_Registry;
+    }
+
+    inline uint64_t Handler::Version() const {
+        return m_Version.load(std::memory_order_acquire);
+    }
+
+    inline std::vector<std::pair<uint32_t, Metrics>> Handler::CollectMetrics() const {
+        std::shared_ptr<const Registry> registry = Snapshot();
+        std::vector<std::pair<uint32_t, Metrics>> metrics;
+        metrics.reserve(registry->size());
+        for(auto& [key, generator] : *registry)
+            metrics.emplace_back(key, generator->GetMetrics());
+        std::sort(metrics.begin(), metrics.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        return metrics;
+    }
+
+    inline std::string Handler::ExportMetrics(MetricsFormat format) const {
+        // TEXT follows the Prometheus exposition format, JSON lists generators by key.
+        std::vector<std::pair<uint32_t, Metrics>> metrics = CollectMetrics();
+        std::string out;
+        auto append = [&](const char* fmt, auto... args) {
+            char buffer[256];
+            snprintf(buffer, sizeof(buffer), fmt, args...);
+            out += buffer;
+        };
+
+        if(format == MetricsFormat::JSON) {
+            out += "{\"generators\":[";
+            for(size_t i = 0; i < metrics.size(); i++) {
+                const auto& [key, m] = metrics[i];
+                append("%s{\"key\":%u", i > 0 ? "," : "", key);
+                for(size_t c = 0; c < Metrics::COUNTERS; c++)
+                    append(",\"%s\":%llu", Metrics::Name((Metrics::Counter) c), (unsigned long long) m.counters[c]);
+                append(",\"max_depth\":%llu,\"latencies\":[", (unsigned long long) m.maxDepth);
+                for(size_t b = 0; b < Metrics::LATENCY_BUCKETS; b++)
+                    append("%s%llu", b > 0 ? "," : "", (unsigned long long) m.latencies[b]);
+                out += "]}";
+            }
+            out += "]}\n";
+            return out;
+        }
+
+        for(size_t c = 0; c < Metrics::COUNTERS; c++) {
+            append("# TYPE nage_%s counter\n", Metrics::Name((Metrics::Counter) c));
+            for(const auto& [key, m] : metrics)
+                append("nage_%s{generator=\"%u\"} %llu\n", Metrics::Name((Metrics::Counter) c), key, (unsigned long long) m.counters[c]);
+        }
+        out += "# TYPE nage_max_depth gauge\n";
+        for(const auto& [key, m] : metrics)
+            append("nage_max_depth{generator=\"%u\"} %llu\n", key, (unsigned long long) m.maxDepth);
+        out += "# TYPE nage_latency_ns histogram\n";
+        for(const auto& [key, m] : metrics) {
+            uint64_t cumulative = 0;
+            for(size_t b = 0; b < Metrics::LATENCY_BUCKETS; b++) {
+                cumulative += m.latencies[b];
+                if(m.latencies[b] != 0 || b + 1 == Metrics::LATENCY_BUCKETS)
+                    append("nage_latency_ns_bucket{generator=\"%u\",le=\"%llu\"} %llu\n", key, 2ULL << b, (unsigned long long) cumulative);
+            }
+            append("nage_latency_ns_bucket{generator=\"%u\",le=\"+Inf\"} %llu\n", key, (unsigned long long) cumulative);
+            append("nage_latency_ns_count{generator=\"%u\"} %llu\n", key, (unsigned long long) cumulative);
+        }
+        return out;
+    }
+
+    inline bool Handler::SaveImage(const std::string& fileName, std::vector<uint32_t>* skipped) const {
+        return Image::Save(*Snapshot(), fileName, skipped);
+    }
+
+    inline bool Handler::LoadImage(const std::string& fileName, bool isVerified) {
+        // Replaces every generator at once, like Clear() followed by a Put() of each one.
+        auto registry = std::make_shared<Registry>();
+        if(!Image::Load(fileName, *registry, isVerified))
+            return false;
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        Publish(std::move(registry));
+        return true;
+    }
+
+    inline void Handler::Publish(std::shared_ptr<const Registry> registry) {
+        // Called with the mutex held.
+        m_Registry = std::move(registry);
+        m_Version.fetch_add(1, std::memory_order_release);
     }
 
     /***********************************************************
@@ -218,15 +1606,304 @@ namespace nage {
 
     inline size_t string::StrLength(const std::string& str) {
         size_t len = 0;
-        for(size_t i = 0; i < str.length(); i += CharLength(str[i]))
-            len++;
+        size_t i = 0;
+        while(i < str.length()) {
+            size_t ascii = AsciiLength(str.data() + i, str.length() - i);
+            len += ascii;
+            i += ascii;
+            if(i < str.length()) {
+                i += CharLength(str[i]);
+                len++;
+            }
+        }
         return len;
     }
 
+    inline size_t string::AsciiLength(const char* str, size_t length) {
+        // Length of the leading run of ASCII bytes, 16 (SSE2) or 8 bytes at a time.
+        size_t i = 0;
+    #ifdef NAGE_SSE2
+        for(; i + 16 <= length; i += 16) {
+            if(_mm_movemask_epi8(_mm_loadu_si128((const __m128i*) (str + i))) != 0)
+                break;
+        }
+    #endif
+        for(; i + 8 <= length; i += 8) {
+            uint64_t word;
+            memcpy(&word, str + i, 8);
+            if((word & 0x8080808080808080ULL) != 0)
+                break;
+        }
+        while(i < length && (unsigned char) str[i] < 0x80)
+            i++;
+        return i;
+    }
+
+    inline bool string::IsValid(const char* str, size_t length) {
+        // Strict UTF-8: no overlong forms, surrogates or code points past U+10FFFF.
+        size_t i = 0;
+        while(true) {
+            i += AsciiLength(str + i, length - i);
+            if(i == length)
+                return true;
+
+            unsigned char lead = (unsigned char) str[i];
+            size_t charLength = CharLength(str[i]);
+            unsigned char min = 0x80, max = 0xBF;
+            if(lead < 0xC2 || lead > 0xF4)
+                return false;
+            if(lead == 0xE0)
+                min = 0xA0;
+            else if(lead == 0xED)
+                max = 0x9F;
+            else if(lead == 0xF0)
+                min = 0x90;
+            else if(lead == 0xF4)
+                max = 0x8F;
+            if(i + charLength > length)
+                return false;
+            unsigned char second = (unsigned char) str[i + 1];
+            if(second < min || second > max)
+                return false;
+            for(size_t j = 2; j < charLength; j++) {
+                if(((unsigned char) str[i + j] & 0xC0) != 0x80)
+                    return false;
+            }
+            i += charLength;
+        }
+    }
+
+    inline uint32_t string::Decode(const char* str, size_t length, size_t& i) {
+        unsigned char lead = (unsigned char) str[i];
+        size_t charLength = CharLength(str[i]);
+
+        // Stray or truncated bytes are escaped into U+DC80..U+DCFF so they survive a round-trip.
+        if(lead < 0x80 || charLength == 1 || i + charLength > length) {
+            i++;
+            return (lead < 0x80) ? lead : (0xDC00 | lead);
+        }
+
+        uint32_t codePoint = lead & (0xFF >> (charLength + 1));
+        for(size_t j = 1; j < charLength; j++)
+            codePoint = (codePoint << 6) | ((unsigned char) str[i + j] & 0x3F);
+        i += charLength;
+        return codePoint;
+    }
+
+    inline void string::Decode(std::string_view str, std::vector<uint32_t>& codePoints) {
+        // Appends the code points of `str`, copying runs of ASCII bytes directly.
+        size_t i = 0;
+        while(i < str.length()) {
+            size_t ascii = AsciiLength(str.data() + i, str.length() - i);
+            codePoints.insert(codePoints.end(), (const unsigned char*) str.data() + i, (const unsigned char*) str.data() + i + ascii);
+            i += ascii;
+            if(i < str.length())
+                codePoints.push_back(Decode(str.data(), str.length(), i));
+        }
+    }
+
+    inline void string::Encode(uint32_t codePoint, std::string& str) {
+        if(codePoint < 0x80) {
+            str += (char) codePoint;
+        }
+        else if(codePoint >= 0xDC80 && codePoint <= 0xDCFF) {
+            str += (char) (codePoint & 0xFF);
+        }
+        else if(codePoint < 0x800) {
+            str += (char) (0xC0 | (codePoint >> 6));
+            str += (char) (0x80 | (codePoint & 0x3F));
+        }
+        else if(codePoint < 0x10000) {
+            str += (char) (0xE0 | (codePoint >> 12));
+            str += (char) (0x80 | ((codePoint >> 6) & 0x3F));
+            str += (char) (0x80 | (codePoint & 0x3F));
+        }
+        else {
+            str += (char) (0xF0 | (codePoint >> 18));
+            str += (char) (0x80 | ((codePoint >> 12) & 0x3F));
+            str += (char) (0x80 | ((codePoint >> 6) & 0x3F));
+            str += (char) (0x80 | (codePoint & 0x3F));
+        }
+    }
+
     /***********************************************************
     *                      FILE FUNCTIONS                      *
     ***********************************************************/
 
+    inline file::MappedFile::MappedFile() {
+        m_Data = nullptr;
+        m_Size = 0;
+        m_IsOpen = false;
+        m_IsMapped = false;
+    }
+
+    inline file::MappedFile::MappedFile(const std::string& fileName, bool isSequential) : MappedFile() {
+        Open(fileName, isSequential);
+    }
+
+    inline file::MappedFile::~MappedFile() {
+        Close();
+    }
+
+    inline bool file::MappedFile::Open(const std::string& fileName, bool isSequential) {
+        Close();
+    #if defined(NAGE_MMAP)
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if(fd < 0)
+            return false;
+        struct stat st;
+        if(fstat(fd, &st) != 0) {
+            close(fd);
+            return false;
+        }
+        m_Size = st.st_size;
+        if(m_Size > 0) {
+            void* data = mmap(nullptr, m_Size, PROT_READ, MAP_SHARED, fd, 0);
+            if(data == MAP_FAILED) {
+                close(fd);
+                m_Size = 0;
+                return false;
+            }
+        #if defined(MADV_SEQUENTIAL) && defined(MADV_WILLNEED)
+            if(isSequential) {
+                madvise(data, m_Size, MADV_SEQUENTIAL);
+                madvise(data, m_Size, MADV_WILLNEED);
+            }
+        #endif
+            m_Data = (const char*) data;
+            m_IsMapped = true;
+        }
+        close(fd);
+    #else
+        std::ifstream file(fileName, std::ios::binary);
+        if(!file)
+            return false;
+        m_Buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        m_Data = m_Buffer.data();
+        m_Size = m_Buffer.size();
+    #endif
+        m_IsOpen = true;
+        return true;
+    }
+
+    inline void file::MappedFile::Close() {
+    #if defined(NAGE_MMAP)
+        if(m_IsMapped)
+            munmap((void*) m_Data, m_Size);
+    #endif
+        m_Buffer.clear();
+        m_Data = nullptr;
+        m_Size = 0;
+        m_IsOpen = false;
+        m_IsMapped = false;
+    }
+
+    inline bool file::MappedFile::IsOpen() const {
+        return m_IsOpen;
+    }
+
+    inline const char* file::MappedFile::Data() const {
+        return m_Data;
+    }
+
+    inline size_t file::MappedFile::Size() const {
+        return m_Size;
+    }
+
+    inline std::string_view file::MappedFile::View() const {
+        return std::string_view(m_Data, m_Size);
+    }
+
+    inline uint64_t file::Hash(const void* data, size_t size, uint64_t seed) {
+        // Word-at-a-time multiply-rotate hash, fast enough to checksum large caches on load.
+        const unsigned char* bytes = (const unsigned char*) data;
+        uint64_t hash = seed ^ (size * 0x9E3779B97F4A7C15ULL);
+        auto mix = [&](uint64_t word) {
+            hash ^= word * 0xBF58476D1CE4E5B9ULL;
+            hash = ((hash << 31) | (hash >> 33)) * 0x94D049BB133111EBULL;
+        };
+
+        size_t i = 0;
+        for(; i + 8 <= size; i += 8) {
+            uint64_t word;
+            memcpy(&word, bytes + i, 8);
+            mix(word);
+        }
+        if(i < size) {
+            uint64_t word = 0;
+            memcpy(&word, bytes + i, size - i);
+            mix(word);
+        }
+        return Random::SplitMix(hash);
+    }
+
+    inline bool file::GetFingerprint(const std::string& fileName, Fingerprint& fingerprint, bool withHash) {
+        std::error_code error;
+        fingerprint.size = std::filesystem::file_size(fileName, error);
+        if(error)
+            return false;
+        fingerprint.time = std::filesystem::last_write_time(fileName, error).time_since_epoch().count();
+        if(error)
+            return false;
+        fingerprint.hash = 0;
+        if(withHash) {
+            MappedFile mapped(fileName, true);
+            if(!mapped.IsOpen())
+                return false;
+            fingerprint.hash = Hash(mapped.Data(), mapped.Size());
+        }
+        return true;
+    }
+
+    inline bool file::IsSameSource(const Fingerprint& cached, const std::string& fileName) {
+        // Same size and modification time are trusted, otherwise the content decides.
+        Fingerprint current;
+        if(!GetFingerprint(fileName, current, false))
+            return false;
+        if(current.size != cached.size)
+            return false;
+        if(current.time == cached.time)
+            return true;
+        return GetFingerprint(fileName, current, true) && current.hash == cached.hash;
+    }
+
+    inline bool file::Replace(const std::string& fileName, std::initializer_list<std::string_view> parts) {
+        // Writes next to the file and renames, so that processes mapping the previous file
+        // keep a consistent view of it. The temporary name is unique to the process and the
+        // call, so that concurrent saves of the same file never write to the same one.
+        static std::atomic<uint64_t> s_Counter = 0;
+        std::random_device device;
+        uint64_t id = ((uint64_t) device() << 32) ^ device() ^ s_Counter.fetch_add(1, std::memory_order_relaxed);
+    #if defined(NAGE_MMAP)
+        id ^= (uint64_t) getpid() << 40;
+    #endif
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), ".%016llx.tmp", (unsigned long long) Random::SplitMix(id));
+
+        std::error_code error;
+        std::filesystem::path path(fileName);
+        if(path.has_parent_path())
+            std::filesystem::create_directories(path.parent_path(), error);
+        std::string temporary = fileName + suffix;
+        {
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            bool isWritten = (bool) file;
+            for(std::string_view part : parts) {
+                if(isWritten && !file.write(part.data(), part.size()))
+                    isWritten = false;
+            }
+            if(!isWritten) {
+                file.close();
+                std::filesystem::remove(temporary, error);
+                return false;
+            }
+        }
+        std::filesystem::rename(temporary, fileName, error);
+        if(error)
+            std::filesystem::remove(temporary, error);
+        return !error;
+    }
+
     template <typename T>
     inline T file::Read(std::ifstream& file) {
         return Read<T>(file, sizeof(T));
@@ -234,10 +1911,8 @@ namespace nage {
     
     template <typename T>
     inline T file::Read(std::ifstream& file, size_t length) {
-        char* bytes = Read<char*>(file, sizeof(T));
         T value;
-        memcpy((void*) &value, &bytes[0], sizeof(T));
-        delete[] bytes;
+        file.read((char*) &value, std::min(length, sizeof(T)));
         return value;
     }
     
@@ -251,9 +1926,8 @@ namespace nage {
     template <>
     inline std::string file::Read<std::string>(std::ifstream& file) {
         size_t length = Read<uint16_t>(file);
-        char* bytes = Read<char*>(file, length);
-        std::string value = std::string(bytes, length);
-        delete[] bytes;
+        std::string value(length, '\0');
+        file.read(value.data(), length);
         return value;
     }
     
@@ -274,367 +1948,4183 @@ namespace nage {
     }
 
     /***********************************************************
-    *                  GENERATOR FUNCTIONS                     *
+    *                         RANDOM                           *
     ***********************************************************/
-    
-    inline Generator::Generator() {
 
+    inline Random::Random() {
+        std::random_device device;
+        Seed(((uint64_t) device() << 32) ^ device());
     }
 
-    template<typename G> inline PreparedGenerator<G> Generator::Prepare() {
-        return PreparedGenerator<G>(static_cast<G*>(this));
+    inline Random::Random(uint64_t seed) {
+        Seed(seed);
     }
 
-    template<typename G> inline PreparedGenerator<G>::PreparedGenerator(G* generator) {
-        m_Generator = generator;
+    inline void Random::Seed(uint64_t seed) {
+        for(uint64_t& state : m_State)
+            state = SplitMix(seed);
     }
 
-    template<typename G> inline PreparedGenerator<G> PreparedGenerator<G>::Filter(std::function<bool(const std::string&)> pred) {
-        m_Filters.push_back(pred);
-        return *this;
+    inline uint64_t Random::Next() {
+        uint64_t result = m_State[1] * 5;
+        result = ((result << 7) | (result >> 57)) * 9;
+        uint64_t t = m_State[1] << 17;
+        m_State[2] ^= m_State[0];
+        m_State[3] ^= m_State[1];
+        m_State[1] ^= m_State[2];
+        m_State[0] ^= m_State[3];
+        m_State[2] ^= t;
+        m_State[3] = (m_State[3] << 45) | (m_State[3] >> 19);
+        return result;
     }
 
-    template<typename G> inline PreparedGenerator<G> PreparedGenerator<G>::Edit(std::function<std::string(std::string)> mod) {
-        m_Modifiers.push_back(mod);
-        return *this;
+    inline double Random::NextDouble() {
+        // 53 random bits scaled into [0, 1).
+        return (Next() >> 11) * 0x1.0p-53;
     }
-    
-    template<typename G> inline PreparedGenerator<G> PreparedGenerator<G>::Generate(std::function<std::string(G*)> generate) {
-        m_Generate = generate;
-        return *this;
+
+    inline uint64_t Random::NextBelow(uint64_t bound) {
+        if(bound == 0)
+            return 0;
+        // Lemire's multiply-shift with rejection, which removes the bias of a modulo. The
+        // threshold, and its division, is only needed when the low word falls below `bound`.
+    #if defined(__SIZEOF_INT128__)
+        unsigned __int128 m = (unsigned __int128) Next() * bound;
+        if((uint64_t) m < bound) {
+            uint64_t threshold = (0 - bound) % bound;
+            while((uint64_t) m < threshold)
+                m = (unsigned __int128) Next() * bound;
+        }
+        return (uint64_t) (m >> 64);
+    #else
+        uint64_t threshold = (0 - bound) % bound;
+        while(true) {
+            uint64_t r = Next();
+            if(r >= threshold)
+                return r % bound;
+        }
+    #endif
     }
 
-    template<typename G> inline std::string PreparedGenerator<G>::Get() {
-        std::string token = "";
-        bool isValid = true;
+    inline uint64_t Random::operator()() {
+        return Next();
+    }
 
-        //TODO: replace infinite loop
-        do {
-            isValid = true;
-            token = m_Generate(m_Generator);
-            for(auto& pred : m_Filters)
-                isValid &= pred(token);
-        } while(!isValid);
+    inline uint64_t Random::SplitMix(uint64_t& state) {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
 
-        for(auto& mod : m_Modifiers)
-            token = mod(token);
+    inline ScopedRandom::ScopedRandom(Random& random) {
+        m_Previous = g_ScopedRandom;
+        g_ScopedRandom = &random;
+    }
 
-        return token;
+    inline ScopedRandom::~ScopedRandom() {
+        g_ScopedRandom = m_Previous;
     }
 
     /***********************************************************
-    *                     LIST GENERATOR                       *
+    *                         ARRAY                            *
     ***********************************************************/
-   
-    inline ListGenerator::ListGenerator() {    
+
+    template<typename T> inline Array<T>::Array() {
+        m_Borrowed = nullptr;
+        m_Size = 0;
     }
 
-    inline ListGenerator::ListGenerator(const std::vector<std::string>& tokens) {
-        AddFromList(tokens);
+    template<typename T> inline void Array<T>::Borrow(const T* data, size_t size, std::shared_ptr<const void> owner) {
+        static_assert(std::is_trivially_copyable<T>::value, "nage: borrowed arrays must be trivially copyable");
+        m_Items.clear();
+        m_Items.shrink_to_fit();
+        m_Borrowed = data;
+        m_Size = size;
+        m_Owner = std::move(owner);
     }
 
-    inline ListGenerator::ListGenerator(const std::string& fileName) {
-        AddFromFile(fileName);
+    template<typename T> inline bool Array<T>::IsBorrowed() const {
+        return m_Owner != nullptr;
     }
 
-    inline std::string ListGenerator::Generate() {
-        if(m_Tokens.empty())
-            return "";
-        return m_Tokens.at(rand()%m_Tokens.size());
+    template<typename T> inline size_t Array<T>::size() const {
+        return m_Owner ? m_Size : m_Items.size();
     }
 
-    inline void ListGenerator::Add(std::string token) {
-        m_Tokens.push_back(token);
+    template<typename T> inline bool Array<T>::empty() const {
+        return size() == 0;
     }
 
-    inline void ListGenerator::AddFromList(const std::vector<std::string>& tokens) {
-        //TODO: check for duplicates?
-        for(auto token : tokens)
-            m_Tokens.push_back(token);
+    template<typename T> inline const T* Array<T>::data() const {
+        return m_Owner ? m_Borrowed : m_Items.data();
     }
 
-    inline void ListGenerator::AddFromFile(const std::string& fileName) {
-        std::ifstream file(fileName);
-        if(!file)
-            return;
-        std::string line;
-        while(getline(file, line))
-            m_Tokens.push_back(line);
-        file.close();
+    template<typename T> inline T* Array<T>::data() {
+        Own();
+        return m_Items.data();
     }
 
-    /***********************************************************
-    *                 MARKOV CHAIN GENERATOR                   *
-    ***********************************************************/
-    
-    inline MarkovChainGenerator::MarkovChainGenerator(int order) {
-        m_Order = order;
+    template<typename T> inline const T* Array<T>::begin() const {
+        return data();
     }
 
-    inline MarkovChainGenerator::MarkovChainGenerator(int order, const std::string& fileName) {
-        m_Order = order;
+    template<typename T> inline const T* Array<T>::end() const {
+        return data() + size();
     }
 
-    inline std::string MarkovChainGenerator::Generate() {
-        if(m_Probabilities.empty())
-            return  "";
-        
-        std::string token = "\002";
-        const int maxLength = 10;
-
-        for(int i = 0; i < maxLength; i++) {
-            // Pick a random value between 0 and 1.
-            double r = (double) rand() / (double) INT_MAX;
-
-            for(int k = m_Order; k > 1; k--) {
-                int start = std::min((int) token.length()-1, std::max(0, i+1 - k));
-                int len = std::min((int) token.size() - start, k);
-                std::string chunk = token.substr(start, len);
-
-                // Determine which character has been picked.
-                // TODO: can be improved if r > 0.5 by looping in reverse.
-                double j = 0;
-                for(auto [ch, p] : m_Probabilities[chunk]) {
-                    if(j < r && r < j+p) {
-                        token += ch;
-                        break;
-                    }
-                    j += p;
-                }
-                if(m_Probabilities[chunk].size() > 0)
-                    break;
-            }
+    template<typename T> inline T* Array<T>::begin() {
+        return data();
+    }
 
-            if(token[token.size()-1] == '\003') {
-                break;
-            }
-        }
+    template<typename T> inline T* Array<T>::end() {
+        return data() + size();
+    }
+
+    template<typename T> inline const T& Array<T>::back() const {
+        return data()[size() - 1];
+    }
 
-        // Remove 'Start of Text' and 'End of Text' characters.
-        token.erase(0, 1);
-        token.pop_back();
+    template<typename T> inline const T& Array<T>::operator[](size_t i) const {
+        return data()[i];
+    }
 
-        return token;
+    template<typename T> inline T& Array<T>::operator[](size_t i) {
+        Own();
+        return m_Items[i];
     }
 
-    inline void MarkovChainGenerator::Load(const std::string& fileName) {
-        std::ifstream file(fileName, std::ios::binary);
-        if(!file)
-            return;
+    template<typename T> inline void Array<T>::push_back(const T& value) {
+        Own();
+        m_Items.push_back(value);
+    }
 
-        m_Probabilities.clear();
+    template<typename T> inline void Array<T>::append(const T* first, const T* last) {
+        Own();
+        m_Items.insert(m_Items.end(), first, last);
+    }
 
-        size_t count = file::Read<size_t>(file);
+    template<typename T> inline void Array<T>::assign(size_t count, const T& value) {
+        Own();
+        m_Items.assign(count, value);
+    }
 
-        for(size_t i = 0; i < count; i++) {
-            std::string chunk = file::Read<std::string>(file);
-            size_t charactersCount = file::Read<size_t>(file);
+    template<typename T> inline void Array<T>::assign(const T* first, const T* last) {
+        std::vector<T> items(first, last);
+        Own();
+        m_Items = std::move(items);
+    }
 
-            m_Probabilities[chunk] = {};
+    template<typename T> inline void Array<T>::resize(size_t count, const T& value) {
+        Own();
+        m_Items.resize(count, value);
+    }
 
-            for(size_t j = 0; j < charactersCount; j++) {
-                std::string ch = file::Read<std::string>(file);
-                double p = file::Read<double>(file);
-                m_Probabilities[chunk][ch] = p;
-            }
-        }
+    template<typename T> inline void Array<T>::reserve(size_t count) {
+        Own();
+        m_Items.reserve(count);
+    }
 
-        file.close();
+    template<typename T> inline void Array<T>::clear() {
+        m_Items.clear();
+        m_Borrowed = nullptr;
+        m_Size = 0;
+        m_Owner.reset();
     }
 
-    inline void MarkovChainGenerator::Save(const std::string& fileName) {
-        std::ofstream file(fileName, std::ios::binary);
-        if(!file)
+    template<typename T> inline void Array<T>::shrink_to_fit() {
+        Own();
+        m_Items.shrink_to_fit();
+    }
+
+    template<typename T> inline void Array<T>::Own() {
+        if(!m_Owner)
             return;
+        m_Items.assign(m_Borrowed, m_Borrowed + m_Size);
+        m_Borrowed = nullptr;
+        m_Size = 0;
+        m_Owner.reset();
+    }
 
-        file::Write<size_t>(file, m_Probabilities.size());
+    /***********************************************************
+    *                    WEIGHTED SAMPLER                      *
+    ***********************************************************/
 
-        for(auto [chunk, characters] : m_Probabilities) {
-            file::Write<std::string>(file, chunk);
-            file::Write<size_t>(file, characters.size());
-            for(auto [ch, p] : characters) {
-                file::Write<std::string>(file, ch);
-                file::Write<double>(file, p);
-            }
-        }
-        
-        file.close();
+    inline WeightedSampler::WeightedSampler() {
     }
 
-    inline void MarkovChainGenerator::Compute(const std::string& fileName) {
-        std::ifstream file(fileName);
-        if(!file)
-            return;
-        std::map<std::string, std::pair<int, std::map<std::string, int>>> occurrences;
-        std::string line;
+    inline WeightedSampler::WeightedSampler(const std::vector<double>& weights) {
+        Build(weights.data(), weights.size());
+    }
 
-        while(getline(file, line)) {
+    inline void WeightedSampler::Build(const double* weights, size_t count) {
+        m_Probabilities.resize(count);
+        m_Aliases.resize(count);
+        m_Cumulative.resize(count);
 
-            // Add 'Start of Text' and 'End of Text' characters.
-            line = "\002" + line + "\003";
+        double sum = 0;
+        for(size_t i = 0; i < count; i++) {
+            sum += weights[i];
+            m_Cumulative[i] = sum;
+        }
+        BuildAlias(weights, count, m_Probabilities.data(), m_Aliases.data());
+    }
 
-            for(size_t i = 0; i < line.length();) {
-                size_t charLength = string::CharLength(line[i]);
-                std::string ch = line.substr(i, charLength);
-                std::string chunk = line.substr(i, charLength);
+    inline size_t WeightedSampler::Sample(double r) const {
+        return SampleAlias(m_Probabilities.data(), m_Aliases.data(), m_Probabilities.size(), r);
+    }
 
-                for(int j = 0; j < m_Order; j++) {
-                    if(i + chunk.length() >= line.length())
-                        break;
-                    size_t lastCharLength = string::CharLength(line[i + chunk.length()]);
-                    std::string lastChar = line.substr(i + chunk.length(), lastCharLength);
+    inline size_t WeightedSampler::SampleCumulative(double r) const {
+        if(m_Cumulative.empty())
+            return 0;
+        size_t i = std::upper_bound(m_Cumulative.begin(), m_Cumulative.end(), r * m_Cumulative.back()) - m_Cumulative.begin();
+        return std::min(i, m_Cumulative.size() - 1);
+    }
 
-                    if(occurrences.count(chunk) == 0)
-                        occurrences[chunk] = {0, {}};
-                    if(occurrences[chunk].second.count(lastChar) == 0)
-                        occurrences[chunk].second[lastChar] = 0;
-                    occurrences[chunk].second[lastChar]++;
-                    occurrences[chunk].first++;
+    inline size_t WeightedSampler::Size() const {
+        return m_Probabilities.size();
+    }
 
-                    chunk += lastChar;
-                }
-                i += charLength;
-            }
+    inline bool WeightedSampler::Empty() const {
+        return m_Probabilities.empty();
+    }
+
+    inline void WeightedSampler::BuildAlias(const double* weights, size_t count, double* probabilities, uint32_t* aliases) {
+        double sum = 0;
+        for(size_t i = 0; i < count; i++)
+            sum += weights[i];
+
+        // Scale weights so that the average bucket is 1, then pair every underfull bucket
+        // with an overfull one which gives it the rest of its mass. Both stacks share one
+        // buffer: underfull buckets grow from the front, overfull ones from the back.
+        std::vector<uint32_t> stacks(count);
+        size_t small = 0, large = count;
+        for(size_t i = 0; i < count; i++) {
+            probabilities[i] = (sum > 0) ? weights[i] * count / sum : 1;
+            aliases[i] = i;
+            if(probabilities[i] < 1)
+                stacks[small++] = i;
+            else
+                stacks[--large] = i;
         }
 
-        for(auto [chunk, characters] : occurrences) {
-            for(auto [ch, count] : characters.second) {
-                double probability = (double) count / (double) characters.first;
-                m_Probabilities[chunk][ch] = probability;
+        while(small > 0 && large < count) {
+            uint32_t less = stacks[--small];
+            uint32_t more = stacks[large];
+            aliases[less] = more;
+            probabilities[more] = (probabilities[more] + probabilities[less]) - 1;
+            if(probabilities[more] < 1) {
+                large++;
+                stacks[small++] = more;
             }
         }
 
-        file.close();
+        // Leftovers are only off by rounding errors.
+        for(size_t i = 0; i < small; i++)
+            probabilities[stacks[i]] = 1;
+        for(size_t i = large; i < count; i++)
+            probabilities[stacks[i]] = 1;
     }
 
-    inline void MarkovChainGenerator::LoadCacheOrCompute(const std::string& cacheFileName, const std::string& fileName) {
-        if(std::filesystem::exists(cacheFileName)) {
-            //TODO: check if source list was updated or cache file invalid.
-            Load(cacheFileName);
-        }
-        else {
-            Compute(fileName);
-            Save(cacheFileName);
+    inline size_t WeightedSampler::SampleAlias(const double* probabilities, const uint32_t* aliases, size_t count, double r) {
+        if(count == 0)
+            return 0;
+        // A single value in [0, 1) picks both the bucket and the coin flip.
+        double x = r * count;
+        size_t i = std::min((size_t) x, count - 1);
+        return (x - i < probabilities[i]) ? i : aliases[i];
+    }
+
+    inline Permutation::Permutation(uint64_t size, uint64_t seed) {
+        m_Size = size;
+        m_Bits = 1;
+        while(m_Bits < 64 && ((size - 1) >> m_Bits) != 0)
+            m_Bits++;
+        for(uint64_t& key : m_Keys)
+            key = Random::SplitMix(seed);
+    }
+
+    inline uint64_t Permutation::Size() const {
+        return m_Size;
+    }
+
+    inline uint64_t Permutation::operator[](uint64_t index) const {
+        if(m_Size <= 1)
+            return 0;
+        // Cycle walking: the network maps [0, 2^bits) onto itself, so following it from an
+        // index below the size comes back below the size.
+        uint64_t x = index;
+        do {
+            x = Encrypt(x);
+        } while(x >= m_Size);
+        return x;
+    }
+
+    inline uint64_t Permutation::Encrypt(uint64_t x) const {
+        // Every round mixes the high part with a hash of the low one, then swaps them.
+        uint32_t low = m_Bits / 2;
+        uint32_t high = m_Bits - low;
+        for(uint64_t key : m_Keys) {
+            uint64_t state = (x & (((uint64_t) 1 << low) - 1)) ^ key;
+            uint64_t mixed = (x >> low) ^ (Random::SplitMix(state) & (((uint64_t) 1 << high) - 1));
+            x = ((x & (((uint64_t) 1 << low) - 1)) << high) | mixed;
+            std::swap(low, high);
         }
+        return x;
     }
 
     /***********************************************************
-    *                   TEMPLATE GENERATOR                     *
+    *                       NAME TABLE                         *
     ***********************************************************/
 
-    inline TemplateGenerator::TemplateGenerator() {
+    inline NameTable::NameTable() {
     }
-    
-    inline TemplateGenerator::TemplateGenerator(const std::string& fileName) {
-        LoadTemplates(fileName);
+
+    inline void NameTable::Reserve(size_t count, size_t bytes) {
+        m_Ends.reserve(m_Ends.size() + count);
+        m_Data.reserve(m_Data.size() + bytes);
     }
-        
-    inline std::string TemplateGenerator::Generate(std::string expr) {
-        std::string str = Evaluate(expr);
-        return str;
+
+    inline void NameTable::Clear() {
+        m_Ends.clear();
+        m_Data.clear();
     }
 
-    inline std::string TemplateGenerator::Generate() {
-        return "";
+    inline void NameTable::Append(std::string_view name) {
+        m_Data.append(name.data(), name.size());
+        m_Ends.push_back(m_Data.size());
     }
 
-    inline std::string TemplateGenerator::Evaluate(std::string& expr, bool isLiteral) {
-        std::vector<std::string> values = {""};
-        std::string str;
+    inline void NameTable::Push() {
+        m_Ends.push_back(m_Data.size());
+    }
+
+    inline void NameTable::Pop() {
+        if(m_Ends.empty())
+            return;
+        m_Ends.pop_back();
+        m_Data.resize(m_Ends.empty() ? 0 : m_Ends.back());
+    }
+
+    inline std::string& NameTable::Buffer() {
+        return m_Data;
+    }
+
+    inline const std::string& NameTable::Data() const {
+        return m_Data;
+    }
+
+    inline size_t NameTable::Size() const {
+        return m_Ends.size();
+    }
+
+    inline bool NameTable::Empty() const {
+        return m_Ends.empty();
+    }
+
+    inline std::string_view NameTable::operator[](size_t i) const {
+        size_t begin = (i == 0) ? 0 : m_Ends[i-1];
+        return std::string_view(m_Data.data() + begin, m_Ends[i] - begin);
+    }
+
+    inline std::vector<std::string> NameTable::ToVector() const {
+        std::vector<std::string> names;
+        names.reserve(Size());
+        for(size_t i = 0; i < Size(); i++)
+            names.emplace_back((*this)[i]);
+        return names;
+    }
+
+    /***********************************************************
+    *                    FINGERPRINT SET                       *
+    ***********************************************************/
+
+    inline FingerprintSet::FingerprintSet() {
+        m_Size = 0;
+    }
+
+    inline bool FingerprintSet::Insert(std::string_view str) {
+        if((m_Size + 1) * 4 > m_Slots.size() * 3)
+            Rehash(std::max<size_t>(64, m_Slots.size() * 2));
+        uint64_t fingerprint = Fingerprint(str);
+        size_t mask = m_Slots.size() - 1;
+        for(size_t slot = fingerprint & mask;; slot = (slot + 1) & mask) {
+            if(m_Slots[slot] == fingerprint)
+                return false;
+            if(m_Slots[slot] == 0) {
+                m_Slots[slot] = fingerprint;
+                m_Size++;
+                return true;
+            }
+        }
+    }
+
+    inline bool FingerprintSet::Contains(std::string_view str) const {
+        if(m_Slots.empty())
+            return false;
+        uint64_t fingerprint = Fingerprint(str);
+        size_t mask = m_Slots.size() - 1;
+        for(size_t slot = fingerprint & mask;; slot = (slot + 1) & mask) {
+            if(m_Slots[slot] == fingerprint)
+                return true;
+            if(m_Slots[slot] == 0)
+                return false;
+        }
+    }
+
+    inline void FingerprintSet::Reserve(size_t count) {
+        size_t slots = 64;
+        while(slots * 3 < count * 4)
+            slots *= 2;
+        if(slots > m_Slots.size())
+            Rehash(slots);
+    }
+
+    inline void FingerprintSet::Clear() {
+        m_Slots.clear();
+        m_Slots.shrink_to_fit();
+        m_Size = 0;
+    }
+
+    inline size_t FingerprintSet::Size() const {
+        return m_Size;
+    }
+
+    inline size_t FingerprintSet::Memory() const {
+        return m_Slots.capacity() * sizeof(uint64_t);
+    }
+
+    inline uint64_t FingerprintSet::Fingerprint(std::string_view str) {
+        // 0 marks empty slots.
+        uint64_t fingerprint = file::Hash(str.data(), str.size());
+        return fingerprint != 0 ? fingerprint : 1;
+    }
+
+    inline void FingerprintSet::Rehash(size_t slots) {
+        std::vector<uint64_t> previous(slots, 0);
+        std::swap(previous, m_Slots);
+        size_t mask = slots - 1;
+        for(uint64_t fingerprint : previous) {
+            if(fingerprint == 0)
+                continue;
+            size_t slot = fingerprint & mask;
+            while(m_Slots[slot] != 0)
+                slot = (slot + 1) & mask;
+            m_Slots[slot] = fingerprint;
+        }
+    }
+
+    /***********************************************************
+    *                      SYMBOL TABLE                        *
+    ***********************************************************/
+
+    inline SymbolTable::SymbolTable() {
+        Clear();
+    }
+
+    inline uint32_t SymbolTable::Intern(std::string_view key) {
+        uint32_t id = Find(key);
+        if(id != NONE)
+            return id;
+
+        id = m_Offsets.size() - 1;
+        m_Pool.append(key);
+        m_Offsets.push_back(m_Pool.size());
+        if(key.size() == 1 && (unsigned char) key[0] < 0x80) {
+            m_Ascii[(unsigned char) key[0]] = id;
+            return id;
+        }
+
+        if((Size() + 1) * 4 > m_Slots.size() * 3) {
+            // Grow and reinsert every key that is not a single ASCII character.
+            m_Slots.assign(std::max<size_t>(64, m_Slots.size() * 2), NONE);
+            for(uint32_t i = 0; i <= id; i++) {
+                std::string_view other = Key(i);
+                if(other.size() == 1 && (unsigned char) other[0] < 0x80)
+                    continue;
+                m_Slots[FindSlot(other, file::Hash(other.data(), other.size()))] = i;
+            }
+        }
+        else
+            m_Slots[FindSlot(key, file::Hash(key.data(), key.size()))] = id;
+        return id;
+    }
+
+    inline uint32_t SymbolTable::Find(std::string_view key) const {
+        if(key.size() == 1 && (unsigned char) key[0] < 0x80)
+            return m_Ascii[(unsigned char) key[0]];
+        if(m_Slots.empty())
+            return NONE;
+        return m_Slots[FindSlot(key, file::Hash(key.data(), key.size()))];
+    }
+
+    inline std::string_view SymbolTable::Key(uint32_t id) const {
+        return std::string_view(m_Pool).substr(m_Offsets[id], m_Offsets[id+1] - m_Offsets[id]);
+    }
+
+    inline size_t SymbolTable::Size() const {
+        return m_Offsets.size() - 1;
+    }
+
+    inline void SymbolTable::Clear() {
+        m_Ascii.fill(NONE);
+        m_Slots.clear();
+        m_Offsets.assign(1, 0);
+        m_Pool.clear();
+    }
+
+    inline uint32_t SymbolTable::FindSlot(std::string_view key, uint64_t hash) const {
+        // Slot holding `key`, or the empty slot where it belongs.
+        size_t mask = m_Slots.size() - 1;
+        for(size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+            if(m_Slots[slot] == NONE || Key(m_Slots[slot]) == key)
+                return slot;
+        }
+    }
+
+    /***********************************************************
+    *                      THREAD POOL                         *
+    ***********************************************************/
+
+    inline ThreadPool::ThreadPool(size_t threads) {
+        m_IsStopping = false;
+        for(size_t i = 0; i < threads; i++)
+            m_Threads.emplace_back([this]() { Work(); });
+    }
+
+    inline ThreadPool::~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_IsStopping = true;
+        }
+        m_Condition.notify_all();
+        for(auto& thread : m_Threads)
+            thread.join();
+    }
+
+    inline void ThreadPool::Submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Tasks.push_back(std::move(task));
+        }
+        m_Condition.notify_one();
+    }
+
+    inline void ThreadPool::ForEach(size_t count, const std::function<void(size_t)>& func) {
+        if(count > UINT32_MAX) {
+            // Ranges are packed on 32 bits, larger batches run in chunks.
+            for(size_t first = 0; first < count; first += UINT32_MAX)
+                ForEach(std::min<size_t>(UINT32_MAX, count - first), [&](size_t i) { func(first + i); });
+            return;
+        }
+        size_t workers = std::min(Size() + 1, count);
+        if(workers <= 1) {
+            for(size_t i = 0; i < count; i++)
+                func(i);
+            return;
+        }
+
+        // Every worker owns a contiguous range of indices packed as (begin, end) in one
+        // atomic word. It takes indices from the front of its range and, once it is empty,
+        // steals from the back of the others.
+        std::vector<std::atomic<uint64_t>> ranges(workers);
+        for(size_t w = 0; w < workers; w++)
+            ranges[w] = ((uint64_t) (count * w / workers) << 32) | (count * (w + 1) / workers);
+
+        auto take = [&](size_t w, bool isFront, size_t& index) {
+            uint64_t range = ranges[w].load(std::memory_order_relaxed);
+            while(true) {
+                uint64_t begin = range >> 32, end = range & UINT32_MAX;
+                if(begin >= end)
+                    return false;
+                uint64_t next = isFront ? (((begin + 1) << 32) | end) : ((begin << 32) | (end - 1));
+                if(ranges[w].compare_exchange_weak(range, next, std::memory_order_relaxed)) {
+                    index = isFront ? begin : end - 1;
+                    return true;
+                }
+            }
+        };
+        auto work = [&](size_t w) {
+            size_t index;
+            while(take(w, true, index))
+                func(index);
+            for(size_t k = 1; k < workers; k++) {
+                while(take((w + k) % workers, false, index))
+                    func(index);
+            }
+        };
+
+        std::mutex mutex;
+        std::condition_variable done;
+        size_t pending = workers - 1;
+        for(size_t w = 1; w < workers; w++) {
+            Submit([&, w]() {
+                work(w);
+                std::lock_guard<std::mutex> lock(mutex);
+                if(--pending == 0)
+                    done.notify_one();
+            });
+        }
+        work(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&]() { return pending == 0; });
+    }
+
+    inline size_t ThreadPool::Size() const {
+        return m_Threads.size();
+    }
+
+    inline void ThreadPool::Work() {
+        while(true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(m_Mutex);
+                m_Condition.wait(lock, [this]() { return m_IsStopping || !m_Tasks.empty(); });
+                if(m_Tasks.empty())
+                    return;
+                task = std::move(m_Tasks.front());
+                m_Tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    /***********************************************************
+    *                        EXECUTOR                          *
+    ***********************************************************/
+
+    inline Executor::Executor(size_t threads, size_t capacity) {
+        m_Pending = 0;
+        m_Capacity = std::max<size_t>(1, capacity);
+        m_IsStopping = false;
+        if(threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        for(size_t i = 0; i < threads; i++)
+            m_Threads.emplace_back([this]() { Work(); });
+    }
+
+    inline Executor::~Executor() {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_IsStopping = true;
+        }
+        m_Condition.notify_all();
+        m_NotFull.notify_all();
+        for(auto& thread : m_Threads)
+            thread.join();
+    }
+
+    inline std::future<NameTable> Executor::Submit(Request request) {
+        Task task{std::move(request), {}, nullptr};
+        std::future<NameTable> future = task.promise.get_future();
+        Push(std::move(task), true);
+        return future;
+    }
+
+    inline void Executor::Submit(Request request, Callback callback) {
+        Push(Task{std::move(request), {}, std::move(callback)}, true);
+    }
+
+    inline bool Executor::TrySubmit(Request request, std::future<NameTable>& future) {
+        Task task{std::move(request), {}, nullptr};
+        std::future<NameTable> result = task.promise.get_future();
+        if(!Push(std::move(task), false))
+            return false;
+        future = std::move(result);
+        return true;
+    }
+
+    inline bool Executor::TrySubmit(Request request, Callback callback) {
+        return Push(Task{std::move(request), {}, std::move(callback)}, false);
+    }
+
+    inline size_t Executor::Pending() const {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return m_Pending;
+    }
+
+    inline size_t Executor::Size() const {
+        return m_Threads.size();
+    }
+
+    inline bool Executor::Push(Task&& task, bool isBlocking) {
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            if(isBlocking)
+                m_NotFull.wait(lock, [this]() { return m_IsStopping || m_Pending < m_Capacity; });
+            if(m_Pending >= m_Capacity && !m_IsStopping)
+                return false;
+            if(m_IsStopping) {
+                lock.unlock();
+                NameTable names;
+                Complete(task, names, std::make_exception_ptr(std::runtime_error("nage: executor is stopping")));
+                return true;
+            }
+            std::deque<Task>& queue = m_Queues[task.request.generator];
+            if(queue.empty() && m_Running.count(task.request.generator) == 0)
+                m_Ready.push_back(task.request.generator);
+            queue.push_back(std::move(task));
+            m_Pending++;
+        }
+        m_Condition.notify_one();
+        return true;
+    }
+
+    inline void Executor::Work() {
+        std::vector<Task> batch;
+        while(true) {
+            uint32_t key;
+            bool isMore;
+            {
+                std::unique_lock<std::mutex> lock(m_Mutex);
+                m_Condition.wait(lock, [this]() { return m_IsStopping || !m_Ready.empty(); });
+                if(m_Ready.empty())
+                    return;
+
+                // Take the oldest requests of the next generator, which stays out of the
+                // line until its batch is done so that no other worker uses it meanwhile.
+                key = m_Ready.front();
+                m_Ready.pop_front();
+                std::deque<Task>& queue = m_Queues[key];
+                size_t count = std::min(queue.size(), MAX_BATCH);
+                for(size_t i = 0; i < count; i++) {
+                    batch.push_back(std::move(queue.front()));
+                    queue.pop_front();
+                }
+                m_Running.insert(key);
+                m_Pending -= count;
+                isMore = !m_Ready.empty();
+            }
+            m_NotFull.notify_all();
+            if(isMore)
+                m_Condition.notify_one();
+            Run(batch);
+            batch.clear();
+
+            // Back to the end of the line when more requests came or remain, so that
+            // generators are served in turn.
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_Running.erase(key);
+                auto queue = m_Queues.find(key);
+                isMore = queue != m_Queues.end() && !queue->second.empty();
+                if(isMore)
+                    m_Ready.push_back(key);
+                else if(queue != m_Queues.end())
+                    m_Queues.erase(queue);
+            }
+            if(isMore)
+                m_Condition.notify_one();
+        }
+    }
+
+    inline void Executor::Run(std::vector<Task>& batch) {
+        uint32_t key = batch.front().request.generator;
+        Handler* handler = GetHandler();
+        std::shared_ptr<Generator> generator = (handler != nullptr) ? handler->Acquire(key) : nullptr;
+        if(generator == nullptr) {
+            auto error = std::make_exception_ptr(std::out_of_range("nage: no generator with key " + std::to_string(key)));
+            NameTable names;
+            for(Task& task : batch)
+                Complete(task, names, error);
+            return;
+        }
+
+        // Unseeded requests without filter are coalesced into one call, then split.
+        size_t shared = 0;
+        for(Task& task : batch) {
+            if(!task.request.seed && !task.request.filter)
+                shared += task.request.count;
+        }
+        NameTable pool;
+        std::exception_ptr poolError;
+        size_t next = 0;
+        if(shared > 0) {
+            try {
+                generator->GenerateN(shared, pool);
+            }
+            catch(...) {
+                poolError = std::current_exception();
+            }
+        }
+
+        for(Task& task : batch) {
+            NameTable names;
+            try {
+                const Request& request = task.request;
+                if(!request.seed && !request.filter) {
+                    if(poolError)
+                        std::rethrow_exception(poolError);
+                    names.Reserve(request.count, 0);
+                    for(size_t i = 0; i < request.count && next < pool.Size(); i++)
+                        names.Append(pool[next++]);
+                }
+                else
+                    Generate(*generator, request, names);
+            }
+            catch(...) {
+                Complete(task, names, std::current_exception());
+                continue;
+            }
+            Complete(task, names, nullptr);
+        }
+    }
+
+    inline void Executor::Generate(Generator& generator, const Request& request, NameTable& names) {
+        std::optional<Random> random;
+        std::optional<ScopedRandom> scope;
+        if(request.seed) {
+            random.emplace(*request.seed);
+            scope.emplace(*random);
+        }
+        if(!request.filter) {
+            generator.GenerateN(request.count, names);
+            return;
+        }
+
+        // Same budget as PreparedGenerator::GetN(): `maxAttempts` candidates per name.
+        NameTable candidates;
+        std::string token;
+        size_t attempts = 0;
+        while(names.Size() < request.count) {
+            candidates.Clear();
+            generator.GenerateN(request.count - names.Size(), candidates);
+            if(candidates.Empty())
+                return;
+            for(size_t i = 0; i < candidates.Size() && names.Size() < request.count; i++) {
+                if(request.maxAttempts > 0 && attempts >= request.maxAttempts)
+                    return;
+                attempts++;
+                token.assign(candidates[i]);
+                if(token.empty() || !request.filter(token))
+                    continue;
+                names.Append(token);
+                attempts = 0;
+            }
+        }
+    }
+
+    inline void Executor::Complete(Task& task, NameTable& names, std::exception_ptr error) {
+        if(task.callback) {
+            task.callback(names, error);
+            return;
+        }
+        if(error)
+            task.promise.set_exception(error);
+        else
+            task.promise.set_value(std::move(names));
+    }
+
+    /***********************************************************
+    *                        METRICS                           *
+    ***********************************************************/
+
+    inline const char* Metrics::Name(Counter counter) {
+        static const char* names[COUNTERS] = {
+            "calls", "names", "allocations", "fallbacks", "template_depth",
+            "filter_evaluations", "filter_rejections"
+        };
+        return names[counter];
+    }
+
+    inline Metrics& Metrics::operator+=(const Metrics& other) {
+        for(size_t i = 0; i < COUNTERS; i++)
+            counters[i] += other.counters[i];
+        for(size_t i = 0; i < LATENCY_BUCKETS; i++)
+            latencies[i] += other.latencies[i];
+        maxDepth = std::max(maxDepth, other.maxDepth);
+        return *this;
+    }
+
+#ifdef NAGE_METRICS
+    inline MetricCounters::MetricCounters() : m_Shards(new Shard[SHARDS]) {
+    }
+
+    inline MetricCounters::MetricCounters(const MetricCounters&) : MetricCounters() {
+    }
+
+    inline MetricCounters& MetricCounters::operator=(const MetricCounters&) {
+        return *this;
+    }
+
+    inline void MetricCounters::Add(Metrics::Counter counter, uint64_t value) {
+        m_Shards[ShardIndex()].counters[counter].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    inline void MetricCounters::AddLatency(uint64_t nanoseconds) {
+        size_t bucket = 0;
+        while(bucket + 1 < Metrics::LATENCY_BUCKETS && (nanoseconds >> (bucket + 1)) != 0)
+            bucket++;
+        m_Shards[ShardIndex()].latencies[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline void MetricCounters::Max(uint64_t depth) {
+        std::atomic<uint64_t>& maxDepth = m_Shards[ShardIndex()].maxDepth;
+        uint64_t current = maxDepth.load(std::memory_order_relaxed);
+        while(depth > current && !maxDepth.compare_exchange_weak(current, depth, std::memory_order_relaxed));
+    }
+
+    inline Metrics MetricCounters::Collect() const {
+        Metrics metrics;
+        for(size_t s = 0; s < SHARDS; s++) {
+            const Shard& shard = m_Shards[s];
+            for(size_t i = 0; i < Metrics::COUNTERS; i++)
+                metrics.counters[i] += shard.counters[i].load(std::memory_order_relaxed);
+            for(size_t i = 0; i < Metrics::LATENCY_BUCKETS; i++)
+                metrics.latencies[i] += shard.latencies[i].load(std::memory_order_relaxed);
+            metrics.maxDepth = std::max(metrics.maxDepth, shard.maxDepth.load(std::memory_order_relaxed));
+        }
+        return metrics;
+    }
+
+    inline size_t MetricCounters::ShardIndex() {
+        static std::atomic<size_t> s_Threads = 0;
+        static thread_local size_t index = s_Threads.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+        return index;
+    }
+
+    inline MetricScope::MetricScope(const Generator* generator, uint64_t names, const std::string* buffer) {
+        static thread_local uint64_t s_Calls = 0;
+        m_Generator = generator;
+        m_Names = names;
+        m_Buffer = buffer;
+        m_Capacity = (buffer != nullptr) ? buffer->capacity() : 0;
+        m_IsTimed = s_Calls++ % Metrics::SAMPLING == 0;
+        if(m_IsTimed)
+            m_Start = std::chrono::steady_clock::now();
+    }
+
+    inline MetricScope::~MetricScope() {
+        if(m_IsTimed)
+            m_Generator->RecordLatency(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_Start).count());
+        m_Generator->RecordMetric(Metrics::CALLS, 1);
+        m_Generator->RecordMetric(Metrics::NAMES, m_Names);
+        if(m_Buffer != nullptr && m_Buffer->capacity() > m_Capacity)
+            m_Generator->RecordMetric(Metrics::ALLOCATIONS, 1);
+    }
+
+    inline DepthScope::DepthScope() {
+        s_Depth++;
+        s_MaxDepth = std::max(s_MaxDepth, s_Depth);
+    }
+
+    inline DepthScope::~DepthScope() {
+        s_Depth--;
+    }
+
+    inline uint64_t DepthScope::TakeMaximum() {
+        uint64_t depth = s_MaxDepth;
+        s_MaxDepth = s_Depth;
+        return depth;
+    }
+#endif
+
+    /***********************************************************
+    *                  GENERATOR FUNCTIONS                     *
+    ***********************************************************/
+    
+    inline Generator::Generator() {
+        m_Random = nullptr;
+    }
+
+    inline void Generator::GenerateInto(std::string& out) {
+        // Replaces the content of `out`. Generators override it to reuse its capacity.
+        out = Generate();
+    }
+
+    inline void Generator::GenerateN(size_t count, NameTable& out) {
+        out.Reserve(count, 0);
+        std::string token;
+        for(size_t i = 0; i < count; i++) {
+            GenerateInto(token);
+            out.Append(token);
+        }
+    }
+
+    inline bool Generator::IsSequential() const {
+        // True when a draw depends on the ones before it (e.g. unique draws of a list), so
+        // that batches must run one after the other to be reproducible.
+        return false;
+    }
+
+    inline std::string Generator::GenerateSeeded(uint64_t seed) {
+        // Generators called from Generate() (including nested ones) draw from the seeded engine.
+        Random random(seed);
+        ScopedRandom scope(random);
+        return Generate();
+    }
+
+    inline void Generator::SetRandom(Random* random) {
+        m_Random = random;
+    }
+
+    inline Random& Generator::GetRandom() {
+        // A scoped engine (e.g. from GenerateSeeded) takes precedence over the injected one.
+        if(g_ScopedRandom == nullptr && m_Random != nullptr)
+            return *m_Random;
+        return nage::GetRandom();
+    }
+
+    inline Metrics Generator::GetMetrics() const {
+#ifdef NAGE_METRICS
+        return m_Metrics.Collect();
+#else
+        return Metrics();
+#endif
+    }
+
+#ifdef NAGE_METRICS
+    inline void Generator::RecordMetric(Metrics::Counter counter, uint64_t value) const {
+        m_Metrics.Add(counter, value);
+    }
+
+    inline void Generator::RecordLatency(uint64_t nanoseconds) const {
+        m_Metrics.AddLatency(nanoseconds);
+    }
+
+    inline void Generator::RecordDepth(uint64_t depth) const {
+        m_Metrics.Add(Metrics::TEMPLATE_DEPTH, depth);
+        m_Metrics.Max(depth);
+    }
+#endif
+
+    template<typename G> inline PreparedGenerator<G> Generator::Prepare() {
+        return PreparedGenerator<G>(static_cast<G*>(this));
+    }
+
+    template<typename G> inline Pipeline<G> Generator::Pipe() {
+        return Pipeline<G>(static_cast<G*>(this));
+    }
+
+    template<typename G> inline PreparedGenerator<G>::PreparedGenerator(G* generator) {
+        m_Generator = generator;
+        m_MaxAttempts = DEFAULT_ATTEMPTS;
+        m_MaxDuration = std::chrono::nanoseconds::zero();
+        Reset();
+    }
+
+    template<typename G> inline PreparedGenerator<G> PreparedGenerator<G>::Filter(std::function<bool(const std::string&)> pred) & {
+        // Predicates taking a std::string_view are accepted as well and see the candidate
+        // buffer itself, without a copy.
+        m_Filters.push_back(std::move(pred));
+        Reset();
+        return *this;
+    }
+
+    template<typename G> inline PreparedGenerator<G> PreparedGenerator<G>::Filter(std::function<bool(const std::string&)> pred) && {
+        m_Filters.push_back(std::move(pred));
+        Reset();
+        return std::move(*this);
+    }
+
+    template<typename G> template<typename F> inline PreparedGenerator<G> PreparedGenerator<G>::Edit(F mod) & {
+        AddModifier(std::move(mod));
+        return *this;
+    }
+
+    template<typename G> template<typename F> inline PreparedGenerator<G> PreparedGenerator<G>::Edit(F mod) && {
+        AddModifier(std::move(mod));
+        return std::move(*this);
+    }
+
+    template<typename G> inline PreparedGenerator<G> PreparedGenerator<G>::Generate(std::function<std::string(G*)> generate) & {
+        m_Generate = std::move(generate);
+        Reset();
+        return *this;
+    }
+
+    template<typename G> inline PreparedGenerator<G> PreparedGenerator<G>::Generate(std::function<std::string(G*)> generate) && {
+        m_Generate = std::move(generate);
+        Reset();
+        return std::move(*this);
+    }
+
+    template<typename G> inline PreparedGenerator<G> PreparedGenerator<G>::Limit(size_t attempts, std::chrono::nanoseconds duration) & {
+        SetLimit(attempts, duration);
+        return *this;
+    }
+
+    template<typename G> inline PreparedGenerator<G> PreparedGenerator<G>::Limit(size_t attempts, std::chrono::nanoseconds duration) && {
+        SetLimit(attempts, duration);
+        return std::move(*this);
+    }
+
+    template<typename G> inline PreparedGenerator<G> PreparedGenerator<G>::Unique(bool isUnique) & {
+        SetUnique(isUnique);
+        return *this;
+    }
+
+    template<typename G> inline PreparedGenerator<G> PreparedGenerator<G>::Unique(bool isUnique) && {
+        SetUnique(isUnique);
+        return std::move(*this);
+    }
+
+    template<typename G> inline void PreparedGenerator<G>::ResetUnique() {
+        if(m_Seen)
+            m_Seen->Clear();
+    }
+
+    template<typename G> inline std::string PreparedGenerator<G>::Get() {
+        std::string token;
+        if(!TryGet(token))
+            return "";
+        return token;
+    }
+
+    template<typename G> inline bool PreparedGenerator<G>::TryGet(std::string& token) {
+        Counters& counters = *m_Counters;
+        uint64_t call = counters.calls.fetch_add(1, std::memory_order_relaxed);
+        bool isTimed = m_MaxDuration.count() > 0 || call % SAMPLING == 0;
+        Clock::time_point start = isTimed ? Clock::now() : Clock::time_point();
+
+        Tally tally;
+        tally.sampling = counters.attempts.load(std::memory_order_relaxed);
+        bool isValid = false;
+        while(!isValid) {
+            if(m_MaxAttempts > 0 && tally.attempts >= m_MaxAttempts)
+                break;
+            if(m_MaxDuration.count() > 0 && tally.attempts > 0 && Clock::now() - start >= m_MaxDuration)
+                break;
+            if(m_Generate)
+                token = m_Generate(m_Generator);
+            else
+                m_Generator->GenerateInto(token);
+            isValid = IsValid(token, tally);
+            if(!isValid)
+                continue;
+            for(auto& mod : m_Modifiers)
+                mod(token);
+            isValid = IsNew(token, tally);
+        }
+        Flush(tally);
+
+        if(!isValid) {
+            counters.failures.fetch_add(1, std::memory_order_relaxed);
+            token.clear();
+        }
+        if(isTimed)
+            Record(start);
+        return isValid;
+    }
+
+    template<typename G> inline size_t PreparedGenerator<G>::GetN(size_t count, NameTable& out) {
+        size_t before = out.Size();
+        if(m_Generate) {
+            out.Reserve(count, 0);
+            std::string token;
+            for(size_t i = 0; i < count && TryGet(token); i++)
+                out.Append(token);
+            return out.Size() - before;
+        }
+        if(m_Filters.empty() && m_Modifiers.empty() && !m_Seen) {
+            m_Counters->calls.fetch_add(count, std::memory_order_relaxed);
+            m_Generator->GenerateN(count, out);
+            m_Counters->attempts.fetch_add(out.Size() - before, std::memory_order_relaxed);
+            return out.Size() - before;
+        }
+
+        // Generate candidates in batches of at most SHARD_SIZE and keep the ones passing
+        // every filter. The batch and token buffers belong to the thread, one pair per
+        // nesting level so that a filter or modifier calling GetN() again does not reuse
+        // the outer ones, and keep their capacity across calls. The batch stops as soon as
+        // one name exhausts its attempts or the whole batch its time budget.
+        Counters& counters = *m_Counters;
+        counters.calls.fetch_add(count, std::memory_order_relaxed);
+        Clock::time_point start = Clock::now();
+        auto duration = m_MaxDuration * count;
+
+        struct Scratch {
+            NameTable batch;
+            std::string token;
+        };
+        struct Level {
+            size_t& depth;
+            ~Level() { depth--; }
+        };
+        static thread_local std::vector<std::unique_ptr<Scratch>> scratches;
+        static thread_local size_t depth = 0;
+        if(depth == scratches.size())
+            scratches.push_back(std::make_unique<Scratch>());
+        NameTable& batch = scratches[depth]->batch;
+        std::string& token = scratches[depth]->token;
+        Level level{++depth};
+        Tally tally;
+        tally.sampling = counters.attempts.load(std::memory_order_relaxed);
+        size_t remaining = count;
+        size_t attempts = 0;
+        bool isExhausted = false;
+        out.Reserve(count, 0);
+
+        while(remaining > 0 && !isExhausted) {
+            batch.Clear();
+            m_Generator->GenerateN(std::min(remaining, SHARD_SIZE), batch);
+            if(batch.Empty())
+                break;
+            for(size_t i = 0; i < batch.Size() && remaining > 0; i++) {
+                if(m_MaxAttempts > 0 && attempts >= m_MaxAttempts) {
+                    isExhausted = true;
+                    break;
+                }
+                attempts++;
+                token.assign(batch[i]);
+                if(!IsValid(token, tally))
+                    continue;
+                for(auto& mod : m_Modifiers)
+                    mod(token);
+                if(!IsNew(token, tally))
+                    continue;
+                out.Append(token);
+                remaining--;
+                attempts = 0;
+            }
+            if(m_MaxDuration.count() > 0 && Clock::now() - start >= duration)
+                isExhausted = true;
+        }
+        Flush(tally);
+        counters.failures.fetch_add(remaining, std::memory_order_relaxed);
+        Record(start);
+        return out.Size() - before;
+    }
+
+    template<typename G> inline size_t PreparedGenerator<G>::GetParallel(size_t count, NameTable& out, uint64_t seed) {
+        return GetParallel(count, out, seed, GetThreadPool());
+    }
+
+    template<typename G> inline size_t PreparedGenerator<G>::GetParallel(size_t count, NameTable& out, uint64_t seed, ThreadPool& pool) {
+        // The batch is cut in fixed-size shards, each drawing from an engine derived from
+        // (seed, shard index) only, so the output does not depend on the number of threads
+        // nor on which thread ran which shard. Filters and modifiers run in the workers.
+        // Unique names depend on every name before them, shards then run in order, and so
+        // they do when the generator keeps such state itself.
+        size_t shardCount = (count + SHARD_SIZE - 1) / SHARD_SIZE;
+        std::vector<NameTable> shards(shardCount);
+
+        auto generate = [&](size_t shard) {
+            uint64_t state = seed ^ (shard * 0xD1B54A32D192ED03ULL);
+            Random random(Random::SplitMix(state));
+            ScopedRandom scope(random);
+            GetN(std::min(SHARD_SIZE, count - shard * SHARD_SIZE), shards[shard]);
+        };
+        if(m_Seen || m_Generator->IsSequential()) {
+            for(size_t shard = 0; shard < shardCount; shard++)
+                generate(shard);
+        }
+        else
+            pool.ForEach(shardCount, generate);
+
+        size_t before = out.Size();
+        size_t bytes = 0;
+        size_t names = 0;
+        for(auto& shard : shards) {
+            bytes += shard.Data().size();
+            names += shard.Size();
+        }
+        out.Reserve(names, bytes);
+        for(auto& shard : shards) {
+            for(size_t i = 0; i < shard.Size(); i++)
+                out.Append(shard[i]);
+        }
+        return out.Size() - before;
+    }
+
+    template<typename G> inline typename PreparedGenerator<G>::Statistics PreparedGenerator<G>::GetStatistics() const {
+        const Counters& counters = *m_Counters;
+        Statistics statistics;
+        statistics.calls = counters.calls.load(std::memory_order_relaxed);
+        statistics.failures = counters.failures.load(std::memory_order_relaxed);
+        statistics.attempts = counters.attempts.load(std::memory_order_relaxed);
+        statistics.duplicates = counters.duplicates.load(std::memory_order_relaxed);
+        for(size_t i = 0; i < LATENCY_BUCKETS; i++)
+            statistics.latencies[i] = counters.latencies[i].load(std::memory_order_relaxed);
+
+        uint64_t order = counters.order.load(std::memory_order_relaxed);
+        for(size_t i = 0; i < m_Filters.size(); i++) {
+            const FilterCounters& filter = counters.filters[i];
+            FilterStatistics filterStatistics;
+            filterStatistics.evaluations = filter.evaluations.load(std::memory_order_relaxed);
+            filterStatistics.rejections = filter.rejections.load(std::memory_order_relaxed);
+            uint64_t timed = filter.timed.load(std::memory_order_relaxed);
+            if(timed > 0)
+                filterStatistics.averageTime = (double) filter.nanoseconds.load(std::memory_order_relaxed) / (double) timed;
+            statistics.filters.push_back(filterStatistics);
+            statistics.order.push_back(i < ORDERED_FILTERS ? (order >> (4 * i)) & 15 : i);
+        }
+        return statistics;
+    }
+
+    template<typename G> inline void PreparedGenerator<G>::ResetStatistics() {
+        Counters& counters = *m_Counters;
+        counters.calls = 0;
+        counters.failures = 0;
+        counters.attempts = 0;
+        counters.duplicates = 0;
+        for(auto& latency : counters.latencies)
+            latency = 0;
+        for(size_t i = 0; i < m_Filters.size(); i++) {
+            counters.filters[i].evaluations = 0;
+            counters.filters[i].rejections = 0;
+            counters.filters[i].timed = 0;
+            counters.filters[i].nanoseconds = 0;
+        }
+    }
+
+    template<typename G> inline PreparedGenerator<G>::Counters::Counters(size_t filterCount) {
+        for(auto& latency : latencies)
+            latency = 0;
+        filters = std::make_unique<FilterCounters[]>(filterCount);
+        uint64_t identity = 0;
+        for(size_t i = 0; i < std::min(filterCount, ORDERED_FILTERS); i++)
+            identity |= (uint64_t) i << (4 * i);
+        order = identity;
+    }
+
+    template<typename G> template<typename F> inline void PreparedGenerator<G>::AddModifier(F mod) {
+        // Modifiers either edit the name in place, `void(std::string&)`, or return the
+        // edited name, `std::string(std::string)`, which is then moved back into place.
+        if constexpr(std::is_void_v<std::invoke_result_t<F&, std::string&>>)
+            m_Modifiers.push_back(std::move(mod));
+        else
+            m_Modifiers.push_back([mod = std::move(mod)](std::string& token) { token = mod(std::move(token)); });
+        Reset();
+    }
+
+    template<typename G> inline void PreparedGenerator<G>::SetLimit(size_t attempts, std::chrono::nanoseconds duration) {
+        // Budget of a single name: at most `attempts` candidates (0 for no limit) and, when
+        // non-zero, `duration`. GetN() gives `count` times the duration to the whole batch.
+        m_MaxAttempts = attempts;
+        m_MaxDuration = duration;
+        Reset();
+    }
+
+    template<typename G> inline void PreparedGenerator<G>::SetUnique(bool isUnique) {
+        // Names already produced (after modifiers) are rejected like filtered ones, using a
+        // FingerprintSet: 11 to 22 MB per million names. The stream reports exhaustion
+        // through the attempt budget once new names become too rare.
+        m_Seen = isUnique ? std::make_shared<FingerprintSet>() : nullptr;
+        Reset();
+    }
+
+    template<typename G> inline bool PreparedGenerator<G>::IsValid(const std::string& token, Tally& tally) const {
+        // Filters run in the order maintained by Reorder() and stop at the first rejection.
+        // Empty candidates, e.g. of an exhausted unique list, are never valid.
+        bool isTimed = (tally.sampling + tally.attempts) % SAMPLING == 0;
+        tally.attempts++;
+        if(token.empty())
+            return false;
+        uint64_t order = m_Counters->order.load(std::memory_order_relaxed);
+        for(size_t i = 0; i < m_Filters.size(); i++) {
+            size_t index = i < ORDERED_FILTERS ? (order >> (4 * i)) & 15 : i;
+            bool isValid;
+            if(isTimed) {
+                Clock::time_point start = Clock::now();
+                isValid = m_Filters[index](token);
+                FilterCounters& filter = m_Counters->filters[index];
+                filter.timed.fetch_add(1, std::memory_order_relaxed);
+                filter.nanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count(), std::memory_order_relaxed);
+            }
+            else
+                isValid = m_Filters[index](token);
+
+            if(index < ORDERED_FILTERS) {
+                tally.evaluations[index]++;
+                tally.rejections[index] += !isValid;
+            }
+            else {
+                m_Counters->filters[index].evaluations.fetch_add(1, std::memory_order_relaxed);
+                m_Counters->filters[index].rejections.fetch_add(!isValid, std::memory_order_relaxed);
+                NAGE_METRIC(m_Generator, FILTER_EVALUATIONS, 1);
+                NAGE_METRIC(m_Generator, FILTER_REJECTIONS, !isValid);
+            }
+            if(!isValid)
+                return false;
+        }
+        return true;
+    }
+
+    template<typename G> inline bool PreparedGenerator<G>::IsNew(const std::string& token, Tally& tally) {
+        if(!m_Seen || m_Seen->Insert(token))
+            return true;
+        tally.duplicates++;
+        return false;
+    }
+
+    template<typename G> inline void PreparedGenerator<G>::Flush(Tally& tally) {
+        Counters& counters = *m_Counters;
+        if(tally.duplicates > 0)
+            counters.duplicates.fetch_add(tally.duplicates, std::memory_order_relaxed);
+        for(size_t i = 0; i < std::min(m_Filters.size(), ORDERED_FILTERS); i++) {
+            if(tally.evaluations[i] == 0)
+                continue;
+            counters.filters[i].evaluations.fetch_add(tally.evaluations[i], std::memory_order_relaxed);
+            counters.filters[i].rejections.fetch_add(tally.rejections[i], std::memory_order_relaxed);
+            NAGE_METRIC(m_Generator, FILTER_EVALUATIONS, tally.evaluations[i]);
+            NAGE_METRIC(m_Generator, FILTER_REJECTIONS, tally.rejections[i]);
+        }
+        uint64_t before = counters.attempts.fetch_add(tally.attempts, std::memory_order_relaxed);
+        if(m_Filters.size() > 1 && before / REORDER_INTERVAL != (before + tally.attempts) / REORDER_INTERVAL)
+            Reorder();
+        tally = Tally();
+    }
+
+    template<typename G> inline void PreparedGenerator<G>::Reorder() {
+        // Independent filters are cheapest to evaluate by increasing cost / rejection rate.
+        // Filters never evaluated yet rank first so that their statistics get collected.
+        Counters& counters = *m_Counters;
+        size_t count = std::min(m_Filters.size(), ORDERED_FILTERS);
+        std::array<double, ORDERED_FILTERS> ranks = {};
+        std::array<size_t, ORDERED_FILTERS> indices = {};
+        for(size_t i = 0; i < count; i++) {
+            const FilterCounters& filter = counters.filters[i];
+            double evaluations = (double) filter.evaluations.load(std::memory_order_relaxed);
+            double rejections = (double) filter.rejections.load(std::memory_order_relaxed);
+            double timed = (double) filter.timed.load(std::memory_order_relaxed);
+            double cost = timed > 0 ? (double) filter.nanoseconds.load(std::memory_order_relaxed) / timed : 0;
+            double rate = evaluations > 0 ? rejections / evaluations : 1;
+            ranks[i] = (cost + 1) / std::max(rate, 1e-6);
+            indices[i] = i;
+        }
+        // Stable insertion sort: std::stable_sort would allocate its buffer on every call.
+        for(size_t i = 1; i < count; i++) {
+            size_t index = indices[i];
+            size_t j = i;
+            for(; j > 0 && ranks[index] < ranks[indices[j-1]]; j--)
+                indices[j] = indices[j-1];
+            indices[j] = index;
+        }
+
+        uint64_t order = 0;
+        for(size_t i = 0; i < count; i++)
+            order |= (uint64_t) indices[i] << (4 * i);
+        counters.order.store(order, std::memory_order_relaxed);
+    }
+
+    template<typename G> inline void PreparedGenerator<G>::Record(Clock::time_point start) {
+        uint64_t nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+        size_t bucket = 0;
+        while(bucket + 1 < LATENCY_BUCKETS && (nanoseconds >> (bucket + 1)) != 0)
+            bucket++;
+        m_Counters->latencies[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    template<typename G> inline void PreparedGenerator<G>::Reset() {
+        m_Counters = std::make_shared<Counters>(m_Filters.size());
+    }
+
+    /***********************************************************
+    *                        PIPELINE                          *
+    ***********************************************************/
+
+    template<typename F> inline bool FilterStep<F>::operator()(std::string& token) {
+        return pred(std::as_const(token));
+    }
+
+    template<typename F> inline bool EditStep<F>::operator()(std::string& token) {
+        // Same modifiers as PreparedGenerator::Edit(): in place or returning the name.
+        if constexpr(std::is_void_v<std::invoke_result_t<F&, std::string&>>)
+            mod(token);
+        else
+            token = mod(std::move(token));
+        return true;
+    }
+
+    template<typename G, typename... Steps> inline Pipeline<G, Steps...>::Pipeline(G* generator) {
+        m_Generator = generator;
+        m_MaxAttempts = PreparedGenerator<G>::DEFAULT_ATTEMPTS;
+    }
+
+    template<typename G, typename... Steps> inline Pipeline<G, Steps...>::Pipeline(G* generator, std::tuple<Steps...>&& steps, size_t maxAttempts)
+        : m_Generator(generator), m_Steps(std::move(steps)), m_MaxAttempts(maxAttempts) {
+    }
+
+    template<typename G, typename... Steps> template<typename F>
+    inline Pipeline<G, Steps..., FilterStep<F>> Pipeline<G, Steps...>::Filter(F pred) && {
+        return Pipeline<G, Steps..., FilterStep<F>>(m_Generator,
+            std::tuple_cat(std::move(m_Steps), std::make_tuple(FilterStep<F>{std::move(pred)})), m_MaxAttempts);
+    }
+
+    template<typename G, typename... Steps> template<typename F>
+    inline Pipeline<G, Steps..., EditStep<F>> Pipeline<G, Steps...>::Edit(F mod) && {
+        return Pipeline<G, Steps..., EditStep<F>>(m_Generator,
+            std::tuple_cat(std::move(m_Steps), std::make_tuple(EditStep<F>{std::move(mod)})), m_MaxAttempts);
+    }
+
+    template<typename G, typename... Steps> inline Pipeline<G, Steps...> Pipeline<G, Steps...>::Limit(size_t attempts) && {
+        // At most `attempts` candidates per name, 0 for no limit.
+        m_MaxAttempts = attempts;
+        return std::move(*this);
+    }
+
+    template<typename G, typename... Steps> inline std::string Pipeline<G, Steps...>::Get() {
+        std::string token;
+        TryGet(token);
+        return token;
+    }
+
+    template<typename G, typename... Steps> inline bool Pipeline<G, Steps...>::TryGet(std::string& token) {
+        for(size_t attempts = 0; m_MaxAttempts == 0 || attempts < m_MaxAttempts; attempts++) {
+            m_Generator->GenerateInto(token);
+            if(!token.empty() && IsValid(token, std::index_sequence_for<Steps...>()))
+                return true;
+        }
+        token.clear();
+        return false;
+    }
+
+    template<typename G, typename... Steps> inline size_t Pipeline<G, Steps...>::GetN(size_t count, NameTable& out) {
+        size_t before = out.Size();
+        std::string token;
+        out.Reserve(count, 0);
+        for(size_t i = 0; i < count && TryGet(token); i++)
+            out.Append(token);
+        return out.Size() - before;
+    }
+
+    template<typename G, typename... Steps> template<size_t... I>
+    inline bool Pipeline<G, Steps...>::IsValid(std::string& token, std::index_sequence<I...>) {
+        return (std::get<I>(m_Steps)(token) && ...);
+    }
+
+    /***********************************************************
+    *                     LIST GENERATOR                       *
+    ***********************************************************/
+   
+    inline ListGenerator::ListGenerator() {    
+    }
+
+    inline ListGenerator::ListGenerator(const std::vector<std::string>& tokens) {
+        AddFromList(tokens);
+    }
+
+    inline ListGenerator::ListGenerator(const std::string& fileName) {
+        AddFromFile(fileName);
+    }
+
+    inline std::string ListGenerator::Generate() {
+        std::string token;
+        GenerateInto(token);
+        return token;
+    }
+
+    inline void ListGenerator::GenerateInto(std::string& out) {
+        NAGE_METRICS_SCOPE(1, &out);
+        out.clear();
+        if(m_IsUnique) {
+            std::lock_guard<std::mutex> lock(m_UniqueMutex);
+            if(m_Remaining > 0)
+                out.assign(At(Draw(GetRandom())));
+            return;
+        }
+        if(m_Size > 0)
+            out.assign(At(GetRandom().NextBelow(m_Size)));
+    }
+
+    inline void ListGenerator::GenerateN(size_t count, NameTable& out) {
+        if(m_Size == 0 || count == 0)
+            return;
+        Random& random = GetRandom();
+        if(m_IsUnique) {
+            std::lock_guard<std::mutex> lock(m_UniqueMutex);
+            count = std::min(count, m_Remaining);
+            NAGE_METRICS_SCOPE(count, &out.Buffer());
+            out.Reserve(count, count * 8);
+            for(size_t i = 0; i < count; i++)
+                out.Append(At(Draw(random)));
+            return;
+        }
+        NAGE_METRICS_SCOPE(count, &out.Buffer());
+        out.Reserve(count, count * 8);
+        for(size_t i = 0; i < count; i++)
+            out.Append(At(random.NextBelow(m_Size)));
+    }
+
+    inline bool ListGenerator::IsSequential() const {
+        return m_IsUnique;
+    }
+
+    inline void ListGenerator::Add(std::string token) {
+        size_t tokensBefore = m_Tokens.size();
+        m_Tokens.push_back(token);
+        m_Size++;
+        Track(tokensBefore, m_Size - m_Tokens.size());
+    }
+
+    inline void ListGenerator::AddFromList(const std::vector<std::string>& tokens) {
+        // Duplicates are kept, making tokens more likely, but drawn once in unique mode.
+        size_t tokensBefore = m_Tokens.size();
+        for(auto token : tokens)
+            m_Tokens.push_back(token);
+        m_Size += tokens.size();
+        Track(tokensBefore, m_Size - m_Tokens.size());
+    }
+
+    inline void ListGenerator::AddFromFile(const std::string& fileName) {
+        std::ifstream file(fileName);
+        if(!file)
+            return;
+        size_t tokensBefore = m_Tokens.size();
+        std::string line;
+        while(getline(file, line)) {
+            m_Tokens.push_back(line);
+            m_Size++;
+        }
+        file.close();
+        Track(tokensBefore, m_Size - m_Tokens.size());
+    }
+
+    inline void ListGenerator::AddFromMappedFile(const std::string& fileName) {
+        auto mapped = std::make_shared<file::MappedFile>();
+        if(!mapped->Open(fileName))
+            return;
+        // Offsets are 32 bits wide to keep the index small.
+        if(mapped->Size() >= UINT32_MAX) {
+            AddFromFile(fileName);
+            return;
+        }
+
+        MappedList list;
+        list.owner = mapped;
+        list.data = mapped->Data();
+        const char* data = mapped->Data();
+        size_t size = mapped->Size();
+        for(size_t i = 0; i < size;) {
+            list.starts.push_back(i);
+            const char* newline = (const char*) memchr(data + i, '\n', size - i);
+            i = (newline == nullptr) ? size + 1 : newline - data + 1;
+        }
+        if(list.starts.empty())
+            return;
+        list.starts.push_back((data[size-1] == '\n') ? size : size + 1);
+        list.starts.shrink_to_fit();
+
+        size_t sizeBefore = m_Size;
+        m_Size += list.starts.size() - 1;
+        m_Lists.push_back(std::move(list));
+        Track(m_Tokens.size(), sizeBefore - m_Tokens.size());
+    }
+
+    inline size_t ListGenerator::Size() const {
+        return m_Size;
+    }
+
+    inline std::string_view ListGenerator::At(size_t i) const {
+        if(i < m_Tokens.size())
+            return m_Tokens[i];
+        i -= m_Tokens.size();
+        for(auto& list : m_Lists) {
+            size_t count = list.starts.size() - 1;
+            if(i < count) {
+                uint32_t begin = list.starts[i];
+                return std::string_view(list.data + begin, list.starts[i+1] - 1 - begin);
+            }
+            i -= count;
+        }
+        return std::string_view();
+    }
+
+    inline void ListGenerator::SetUnique(bool isUnique) {
+        // Tokens are then drawn without replacement (a Fisher-Yates shuffle performed one
+        // draw at a time), each distinct token once until ResetUnique(). This takes 4 bytes
+        // per token plus a FingerprintSet of the distinct tokens. Draws may run on several
+        // threads, but not while the list or its mode changes.
+        std::lock_guard<std::mutex> lock(m_UniqueMutex);
+        m_IsUnique = isUnique;
+        m_Unique.clear();
+        m_Remaining = 0;
+        m_Distinct.Clear();
+        if(isUnique) {
+            m_Distinct.Reserve(m_Size);
+            Track(0, 0);
+        }
+    }
+
+    inline bool ListGenerator::IsUnique() const {
+        return m_IsUnique;
+    }
+
+    inline bool ListGenerator::IsExhausted() const {
+        std::lock_guard<std::mutex> lock(m_UniqueMutex);
+        return m_IsUnique && m_Remaining == 0;
+    }
+
+    inline size_t ListGenerator::Remaining() const {
+        std::lock_guard<std::mutex> lock(m_UniqueMutex);
+        return m_IsUnique ? m_Remaining : m_Size;
+    }
+
+    inline void ListGenerator::ResetUnique() {
+        std::lock_guard<std::mutex> lock(m_UniqueMutex);
+        m_Remaining = m_Unique.size();
+    }
+
+    inline void ListGenerator::Track(size_t tokensBefore, size_t linesBefore) {
+        // Adds the tokens and mapped lines past the given counts to the unique draws. Mapped
+        // lines come after the tokens, their indices move when tokens are added.
+        if(!m_IsUnique)
+            return;
+        size_t added = m_Tokens.size() - tokensBefore;
+        if(added > 0 && !m_Lists.empty()) {
+            for(auto& index : m_Unique) {
+                if(index >= tokensBefore)
+                    index += added;
+            }
+        }
+
+        auto track = [&](size_t index) {
+            if(!m_Distinct.Insert(At(index)))
+                return;
+            m_Unique.push_back(index);
+            std::swap(m_Unique.back(), m_Unique[m_Remaining++]);
+        };
+        for(size_t i = tokensBefore; i < m_Tokens.size(); i++)
+            track(i);
+        for(size_t i = m_Tokens.size() + linesBefore; i < m_Size; i++)
+            track(i);
+    }
+
+    inline size_t ListGenerator::Draw(Random& random) {
+        size_t i = random.NextBelow(m_Remaining);
+        std::swap(m_Unique[i], m_Unique[--m_Remaining]);
+        return m_Unique[m_Remaining];
+    }
+
+    /***********************************************************
+    *                      MARKOV MODEL                        *
+    ***********************************************************/
+
+    inline void MarkovModel::Clear() {
+        start = NONE;
+        end = NONE;
+        symbols.clear();
+        lengths.clear();
+        offsets.clear();
+        edges.clear();
+        pruned.clear();
+        ClearIndex();
+    }
+
+    inline void MarkovModel::ClearIndex() {
+        contexts.clear();
+        contexts.shrink_to_fit();
+        table.clear();
+        table.shrink_to_fit();
+    }
+
+    inline bool MarkovModel::Empty() const {
+        return lengths.empty();
+    }
+
+    inline bool MarkovModel::IsIndexed() const {
+        return !table.empty() || Empty();
+    }
+
+    inline size_t MarkovModel::ContextCount() const {
+        return lengths.size();
+    }
+
+    inline size_t MarkovModel::MemoryUsage() const {
+        // The pruned counts are only read by updates.
+        return symbols.size() * sizeof(uint32_t) + lengths.size() * sizeof(uint8_t) + offsets.size() * sizeof(uint32_t)
+            + edges.size() * sizeof(Edge) + contexts.size() * sizeof(uint32_t) + table.size() * sizeof(uint32_t);
+    }
+
+    inline uint64_t MarkovModel::Hash(const uint32_t* ids, size_t length) {
+        uint64_t hash = length;
+        for(size_t i = 0; i < length; i++)
+            hash = (hash ^ ids[i]) * 0x9E3779B97F4A7C15ULL;
+        return hash ^ (hash >> 32);
+    }
+
+    inline uint32_t MarkovModel::Find(const uint32_t* ids, size_t length) const {
+        if(table.empty() || length == 0 || length > (size_t) order)
+            return NONE;
+
+        size_t mask = table.size() - 1;
+        for(size_t slot = Hash(ids, length) & mask;; slot = (slot + 1) & mask) {
+            uint32_t context = table[slot];
+            if(context == NONE)
+                return NONE;
+            if(lengths[context] == length && memcmp(&contexts[(size_t) context * order], ids, length * sizeof(uint32_t)) == 0)
+                return context;
+        }
+    }
+
+    inline uint32_t MarkovModel::FindLongestSuffix(const uint32_t* ids, size_t length) const {
+        for(size_t k = std::min(length, (size_t) order); k > 0; k--) {
+            uint32_t context = Find(ids + length - k, k);
+            if(context != NONE)
+                return context;
+        }
+        return NONE;
+    }
+
+    inline uint32_t MarkovModel::FindEdge(uint32_t context, uint32_t symbol) const {
+        // Successors are sorted by symbol, the escape edge comes last.
+        const Edge* first = edges.data() + offsets[context];
+        const Edge* last = edges.data() + offsets[context+1];
+        const Edge* edge = std::lower_bound(first, last, symbol, [](const Edge& e, uint32_t s) { return e.symbol < s; });
+        if(edge == last || edge->symbol != symbol || symbol == ESCAPE)
+            return NONE;
+        return edge - edges.data();
+    }
+
+    inline uint32_t MarkovModel::FindNext(uint32_t context, uint32_t level, uint32_t edge) const {
+        // A successor picked after backing off from `context` to `level` leads to the next
+        // context of the longest context in between which has that successor.
+        uint32_t symbol = edges[edge].symbol;
+        for(; context != level; context = edges[offsets[context+1] - 1].next) {
+            uint32_t found = FindEdge(context, symbol);
+            if(found != NONE)
+                return edges[found].next;
+        }
+        return edges[edge].next;
+    }
+
+    inline double MarkovModel::GetTotal(uint32_t context) const {
+        double total = 0;
+        for(uint32_t edge = offsets[context]; edge < offsets[context+1]; edge++)
+            total += edges[edge].count;
+        return total;
+    }
+
+    inline void MarkovModel::BuildIndex() {
+        // Keys are rebuilt by walking the model from the start: a context reached by an edge
+        // ends its source context followed by the successor, an escaped one ends its source.
+        contexts.assign((size_t) ContextCount() * order, NONE);
+        std::vector<uint8_t> isVisited(ContextCount(), 0);
+        std::vector<uint32_t> stack = {start}, ids(order + 1);
+        contexts[(size_t) start * order] = std::lower_bound(symbols.begin(), symbols.end(), (uint32_t) '\002') - symbols.begin();
+        isVisited[start] = 1;
+        while(!stack.empty()) {
+            uint32_t context = stack.back();
+            stack.pop_back();
+            size_t length = lengths[context];
+            std::copy_n(&contexts[(size_t) context * order], length, ids.begin());
+            for(uint32_t edge = offsets[context]; edge < offsets[context+1]; edge++) {
+                uint32_t next = edges[edge].next;
+                if(next == NONE || isVisited[next])
+                    continue;
+                ids[length] = edges[edge].symbol;
+                size_t last = edges[edge].symbol == ESCAPE ? length : length + 1;
+                std::copy_n(&ids[last - lengths[next]], lengths[next], &contexts[(size_t) next * order]);
+                isVisited[next] = 1;
+                stack.push_back(next);
+            }
+        }
+        BuildTable();
+    }
+
+    inline void MarkovModel::BuildTable() {
+        size_t size = 1;
+        while(size < ContextCount() * 2)
+            size <<= 1;
+        table.assign(size, NONE);
+
+        size_t mask = size - 1;
+        for(uint32_t context = 0; context < ContextCount(); context++) {
+            size_t slot = Hash(&contexts[(size_t) context * order], lengths[context]) & mask;
+            while(table[slot] != NONE)
+                slot = (slot + 1) & mask;
+            table[slot] = context;
+        }
+    }
+
+    inline void MarkovModel::BuildTransitions() {
+        // The context following a successor is the longest known suffix of the current
+        // context extended by that successor, which is what backing off from the highest
+        // order would find while generating. Escapes lead to the longest proper suffix.
+        std::vector<uint32_t> ids(order + 1);
+
+        for(uint32_t context = 0; context < ContextCount(); context++) {
+            size_t length = lengths[context];
+            std::copy_n(&contexts[(size_t) context * order], length, ids.begin());
+
+            for(uint32_t edge = offsets[context]; edge < offsets[context+1]; edge++) {
+                edges[edge].next = NONE;
+                if(edges[edge].symbol == end)
+                    continue;
+                if(edges[edge].symbol == ESCAPE) {
+                    edges[edge].next = FindLongestSuffix(ids.data() + 1, length - 1);
+                    continue;
+                }
+                ids[length] = edges[edge].symbol;
+                edges[edge].next = FindLongestSuffix(ids.data(), length + 1);
+            }
+        }
+    }
+
+    inline void MarkovModel::BuildAliases() {
+        for(uint32_t context = 0; context < ContextCount(); context++)
+            BuildAliases(context);
+    }
+
+    inline void MarkovModel::BuildAliases(uint32_t context) {
+        // Successors weigh their counts, less the discount given to the escape if any.
+        uint32_t begin = offsets[context];
+        uint32_t count = offsets[context+1] - begin;
+        bool isEscaping = count > 0 && edges[begin + count - 1].symbol == ESCAPE;
+        double discount = isEscaping ? smoothing.discount : 0;
+        std::vector<double> weights(count), probabilities(count);
+        std::vector<uint32_t> aliases(count);
+        double total = GetTotal(context);
+        double sum = 0;
+        for(uint32_t i = 0; i < count; i++) {
+            // Shares are taken as differences of cumulative probabilities, which keeps the
+            // alias tables and thus the seeded names of the former cumulative layout.
+            double share = isEscaping && i == count - 1 ? discount * (count - 1) : edges[begin + i].count - discount;
+            double previous = sum;
+            sum += share / total;
+            weights[i] = sum - previous;
+        }
+        WeightedSampler::BuildAlias(weights.data(), count, probabilities.data(), aliases.data());
+        for(uint32_t i = 0; i < count; i++) {
+            edges[begin + i].probability = probabilities[i];
+            edges[begin + i].alias = aliases[i];
+        }
+    }
+
+    inline void MarkovModel::RemoveUnreachable() {
+        // Contexts never reached from the start, through successors or escapes, are dropped
+        // and the others renumbered in the same order.
+        std::vector<uint32_t> ids(ContextCount(), NONE);
+        std::vector<uint32_t> stack = {start};
+        ids[start] = 0;
+        while(!stack.empty()) {
+            uint32_t context = stack.back();
+            stack.pop_back();
+            for(uint32_t edge = offsets[context]; edge < offsets[context+1]; edge++) {
+                uint32_t next = edges[edge].next;
+                if(next != NONE && ids[next] == NONE) {
+                    ids[next] = 0;
+                    stack.push_back(next);
+                }
+            }
+        }
+
+        uint32_t count = 0;
+        for(uint32_t context = 0; context < ContextCount(); context++) {
+            if(ids[context] != NONE)
+                ids[context] = count++;
+        }
+        MarkovModel model;
+        model.order = order;
+        model.start = ids[start];
+        model.end = end;
+        model.smoothing = smoothing;
+        model.symbols = std::move(symbols);
+        model.offsets.push_back(0);
+        for(uint32_t context = 0; context < ContextCount(); context++) {
+            if(ids[context] == NONE)
+                continue;
+            model.lengths.push_back(lengths[context]);
+            model.contexts.append(&contexts[(size_t) context * order], &contexts[(size_t) (context + 1) * order]);
+            for(uint32_t edge = offsets[context]; edge < offsets[context+1]; edge++) {
+                Edge e = edges[edge];
+                e.next = e.next == NONE ? NONE : ids[e.next];
+                model.edges.push_back(e);
+            }
+            model.offsets.push_back(model.edges.size());
+        }
+        model.BuildTable();
+        *this = std::move(model);
+    }
+
+    inline bool MarkovModel::IsConsistent(bool isVerified) const {
+        // The sizes of the arrays are always checked. `isVerified` also checks that every
+        // index read by generation and by the index stays within its array: contexts have
+        // 1 to `order` symbols and at least one edge, successors extend their context by
+        // one symbol at most and the escape, last, leads to a shorter context.
+        if(order <= 0 || order > UINT8_MAX || offsets.size() != ContextCount() + 1 || start >= ContextCount()
+            || offsets.back() != edges.size() || pruned.size() % (order + 3) != 0)
+            return false;
+        if(!isVerified)
+            return true;
+        for(size_t context = 0; context < ContextCount(); context++) {
+            uint32_t length = lengths[context];
+            if(length == 0 || length > (uint32_t) order || offsets[context] >= offsets[context + 1])
+                return false;
+            for(uint32_t i = offsets[context]; i < offsets[context + 1]; i++) {
+                const Edge& edge = edges[i];
+                if(edge.alias >= offsets[context + 1] - offsets[context] || (edge.next != NONE && edge.next >= ContextCount())
+                    || (edge.symbol != ESCAPE && edge.symbol >= symbols.size()))
+                    return false;
+                if(edge.symbol == ESCAPE && (i + 1 != offsets[context + 1] || edge.next == NONE || lengths[edge.next] >= length))
+                    return false;
+                if(edge.symbol != ESCAPE && edge.next != NONE && lengths[edge.next] > length + 1)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    inline bool MarkovModel::Save(const std::string& fileName, const file::Fingerprint& source, uint64_t* checksum) const {
+        std::string buffer(sizeof(Header) + 5 * sizeof(Section), '\0');
+        std::vector<Section> sections;
+        auto addSection = [&](uint32_t id, const void* data, size_t elementSize, size_t count) {
+            buffer.resize((buffer.size() + 15) & ~(size_t) 15, '\0');
+            sections.push_back({id, (uint32_t) elementSize, buffer.size(), count});
+            buffer.append((const char*) data, elementSize * count);
+        };
+        addSection(0, symbols.data(), sizeof(uint32_t), symbols.size());
+        addSection(1, lengths.data(), sizeof(uint8_t), lengths.size());
+        addSection(2, offsets.data(), sizeof(uint32_t), offsets.size());
+        addSection(3, edges.data(), sizeof(Edge), edges.size());
+        addSection(4, pruned.data(), sizeof(uint32_t), pruned.size());
+        memcpy(&buffer[sizeof(Header)], sections.data(), sections.size() * sizeof(Section));
+
+        Header header = {};
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.endianness = ENDIANNESS;
+        header.order = order;
+        header.start = start;
+        header.end = end;
+        header.sectionCount = sections.size();
+        header.minCount = smoothing.minCount;
+        header.discount = smoothing.discount;
+        header.sourceSize = source.size;
+        header.sourceTime = source.time;
+        header.sourceHash = source.hash;
+        header.payloadSize = buffer.size() - sizeof(Header);
+        header.checksum = file::Hash(buffer.data() + sizeof(Header), header.payloadSize);
+        memcpy(&buffer[0], &header, sizeof(Header));
+
+        if(!file::Replace(fileName, {buffer}))
+            return false;
+        if(checksum != nullptr)
+            *checksum = header.checksum;
+        return true;
+    }
+
+    inline bool MarkovModel::Load(const std::string& fileName, file::Fingerprint& source, uint64_t* checksum, bool isVerified) {
+        // The header and section table are always checked, and so are the bounds of every
+        // array. `isVerified` also checks the checksum and every index, which reads the
+        // whole cache rather than the pages generation touches.
+        auto mapped = std::make_shared<file::MappedFile>(fileName);
+        if(!mapped->IsOpen() || mapped->Size() < sizeof(Header))
+            return false;
+
+        Header header;
+        memcpy(&header, mapped->Data(), sizeof(Header));
+        if(memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION || header.endianness != ENDIANNESS)
+            return false;
+        if(header.sectionCount != 5 || header.payloadSize != mapped->Size() - sizeof(Header) || header.payloadSize < 5 * sizeof(Section)
+            || header.order == 0)
+            return false;
+        if(isVerified && file::Hash(mapped->Data() + sizeof(Header), header.payloadSize) != header.checksum)
+            return false;
+
+        const Section* sections = (const Section*) (mapped->Data() + sizeof(Header));
+        MarkovModel model;
+        auto borrow = [&](auto& array, uint32_t id) {
+            using T = typename std::decay_t<decltype(array)>::value_type;
+            const Section& section = sections[id];
+            if(section.id != id || section.elementSize != sizeof(T) || section.offset % 16 != 0 || section.offset > mapped->Size()
+                || section.count > (mapped->Size() - section.offset) / sizeof(T))
+                return false;
+            array.Borrow((const T*) (mapped->Data() + section.offset), section.count, mapped);
+            return true;
+        };
+        if(!borrow(model.symbols, 0) || !borrow(model.lengths, 1) || !borrow(model.offsets, 2) || !borrow(model.edges, 3)
+            || !borrow(model.pruned, 4))
+            return false;
+
+        model.order = header.order;
+        model.start = header.start;
+        model.end = header.end;
+        model.smoothing.minCount = header.minCount;
+        model.smoothing.discount = header.discount;
+        if(!model.IsConsistent(isVerified))
+            return false;
+
+        *this = std::move(model);
+        source.size = header.sourceSize;
+        source.time = header.sourceTime;
+        source.hash = header.sourceHash;
+        if(checksum != nullptr)
+            *checksum = header.checksum;
+        return true;
+    }
+
+    /***********************************************************
+    *                     N-GRAM COUNTER                       *
+    ***********************************************************/
+
+    inline NGramCounter::NGramCounter(int order) {
+        m_Order = order;
+        m_Stride = order + 3;
+        m_Slots.assign(1024, UINT32_MAX);
+    }
+
+    inline void NGramCounter::AddLine(std::string_view line, int64_t count) {
+        // Every position of '\002' + line + '\003' is followed by contexts of 1 to `order`
+        // code points, each counted with the code point after it.
+        m_Line.clear();
+        m_Line.push_back('\002');
+        string::Decode(line, m_Line);
+        m_Line.push_back('\003');
+
+        for(size_t i = 0; i < m_Line.size(); i++) {
+            for(size_t length = 1; length <= (size_t) m_Order && i + length < m_Line.size(); length++)
+                Add(&m_Line[i], length, m_Line[i + length], count);
+        }
+    }
+
+    inline void NGramCounter::Add(const uint32_t* context, uint32_t length, uint32_t next, int64_t count) {
+        m_Key.resize(m_Stride - 1);
+        m_Key[0] = length;
+        for(size_t i = 0; i < (size_t) m_Order; i++)
+            m_Key[i + 1] = i < length ? context[i] : 0;
+        m_Key[m_Order + 1] = next;
+
+        // Counts saturate rather than wrap, removing more than was added leaves 0.
+        uint32_t* entry = Find(m_Key.data(), count > 0);
+        if(entry == nullptr)
+            return;
+        int64_t total = (int64_t) entry[m_Stride - 1] + count;
+        entry[m_Stride - 1] = (uint32_t) std::clamp<int64_t>(total, 0, UINT32_MAX);
+    }
+
+    inline uint32_t NGramCounter::Count(const uint32_t* context, uint32_t length, uint32_t next) {
+        m_Key.resize(m_Stride - 1);
+        m_Key[0] = length;
+        for(size_t i = 0; i < (size_t) m_Order; i++)
+            m_Key[i + 1] = i < length ? context[i] : 0;
+        m_Key[m_Order + 1] = next;
+        uint32_t* entry = Find(m_Key.data(), false);
+        return entry ? entry[m_Stride - 1] : 0;
+    }
+
+    inline void NGramCounter::Merge(const NGramCounter& other) {
+        for(size_t i = 0; i < other.Size(); i++) {
+            const uint32_t* entry = other.Entry(i);
+            Add(entry + 1, entry[0], entry[m_Order + 1], entry[m_Stride - 1]);
+        }
+    }
+
+    inline void NGramCounter::Clear() {
+        m_Entries.clear();
+        m_Slots.assign(1024, UINT32_MAX);
+    }
+
+    inline int NGramCounter::Order() const {
+        return m_Order;
+    }
+
+    inline size_t NGramCounter::Size() const {
+        return m_Entries.size() / m_Stride;
+    }
+
+    inline size_t NGramCounter::Stride() const {
+        return m_Stride;
+    }
+
+    inline const uint32_t* NGramCounter::Entry(size_t i) const {
+        return &m_Entries[i * m_Stride];
+    }
+
+    inline std::vector<uint32_t> NGramCounter::Sort() const {
+        // Canonical order: contexts compared code point by code point, a context before
+        // the longer ones it starts, then next code points. This is also the byte order of
+        // the UTF-8 strings, the one of the former std::map based training.
+        std::vector<uint32_t> indices(Size());
+        for(size_t i = 0; i < indices.size(); i++)
+            indices[i] = i;
+        std::sort(indices.begin(), indices.end(), [&](uint32_t a, uint32_t b) {
+            const uint32_t* x = Entry(a);
+            const uint32_t* y = Entry(b);
+            uint32_t length = std::min(x[0], y[0]);
+            for(size_t i = 1; i <= length; i++) {
+                if(x[i] != y[i])
+                    return x[i] < y[i];
+            }
+            if(x[0] != y[0])
+                return x[0] < y[0];
+            return x[m_Order + 1] < y[m_Order + 1];
+        });
+        return indices;
+    }
+
+    inline uint32_t* NGramCounter::Find(const uint32_t* key, bool isInserting) {
+        size_t words = m_Stride - 1;
+        uint64_t hash = MarkovModel::Hash(key, words);
+        size_t mask = m_Slots.size() - 1;
+        for(size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+            uint32_t index = m_Slots[slot];
+            if(index == UINT32_MAX) {
+                if(!isInserting)
+                    return nullptr;
+                m_Slots[slot] = Size();
+                m_Entries.insert(m_Entries.end(), key, key + words);
+                m_Entries.push_back(0);
+                uint32_t* entry = &m_Entries[m_Entries.size() - m_Stride];
+                if(Size() * 2 > m_Slots.size()) {
+                    Grow();
+                    entry = &m_Entries[m_Entries.size() - m_Stride];
+                }
+                return entry;
+            }
+            uint32_t* entry = &m_Entries[(size_t) index * m_Stride];
+            if(memcmp(entry, key, words * sizeof(uint32_t)) == 0)
+                return entry;
+        }
+    }
+
+    inline void NGramCounter::Grow() {
+        m_Slots.assign(m_Slots.size() * 2, UINT32_MAX);
+        size_t mask = m_Slots.size() - 1;
+        for(size_t i = 0; i < Size(); i++) {
+            size_t slot = MarkovModel::Hash(Entry(i), m_Stride - 1) & mask;
+            while(m_Slots[slot] != UINT32_MAX)
+                slot = (slot + 1) & mask;
+            m_Slots[slot] = i;
+        }
+    }
+
+    /***********************************************************
+    *                 MARKOV CHAIN GENERATOR                   *
+    ***********************************************************/
+    
+    inline MarkovChainGenerator::MarkovChainGenerator(int order) : m_Counts(order) {
+        m_Order = order;
+        m_HasCounts = true;
+        m_Checksum = 0;
+        m_IsSourceChanged = false;
+    }
+
+    inline MarkovChainGenerator::MarkovChainGenerator(int order, const std::string& fileName) : MarkovChainGenerator(order) {
+        Compute(fileName);
+    }
+
+    inline std::string MarkovChainGenerator::Generate() {
+        std::string token;
+        GenerateInto(token);
+        return token;
+    }
+
+    inline void MarkovChainGenerator::GenerateInto(std::string& out) {
+        NAGE_METRICS_SCOPE(1, &out);
+        out.clear();
+        if(!m_Model.Empty())
+            Generate(GetRandom(), out);
+    }
+
+    inline void MarkovChainGenerator::SetConstraints(const MarkovConstraints& constraints) {
+        if(constraints.maxLength > MAX_CONSTRAINED_LENGTH)
+            throw std::invalid_argument("nage: maximum length of constrained names is too large");
+        m_Constraints = constraints;
+        m_Plan.isActive = true;
+        BuildPlan();
+    }
+
+    inline void MarkovChainGenerator::ClearConstraints() {
+        m_Constraints = MarkovConstraints();
+        m_Plan = Plan();
+    }
+
+    inline const MarkovConstraints& MarkovChainGenerator::GetConstraints() const {
+        return m_Constraints;
+    }
+
+    inline void MarkovChainGenerator::SetSmoothing(const MarkovSmoothing& smoothing) {
+        // Recompiles a computed or loaded model from its counts.
+        if(smoothing.discount < 0 || smoothing.discount >= 1)
+            throw std::invalid_argument("nage: the discount must be in [0, 1)");
+        m_Smoothing = smoothing;
+        if(m_Model.Empty())
+            return;
+        LoadCounts();
+        Compile(m_Counts);
+        m_Model.ClearIndex();
+    }
+
+    inline const MarkovSmoothing& MarkovChainGenerator::GetSmoothing() const {
+        return m_Smoothing;
+    }
+
+    inline size_t MarkovChainGenerator::MemoryUsage() const {
+        // Bytes of the model, excluding the counts kept for updates.
+        return m_Model.MemoryUsage();
+    }
+
+    inline bool MarkovChainGenerator::IsSatisfiable() const {
+        if(m_Model.Empty())
+            return false;
+        return !m_Plan.isActive || m_Plan.context != MarkovModel::NONE;
+    }
+
+    inline void MarkovChainGenerator::GenerateN(size_t count, NameTable& out) {
+        if(m_Model.Empty())
+            return;
+        NAGE_METRICS_SCOPE(count, &out.Buffer());
+        Random& random = GetRandom();
+        out.Reserve(count, count * 10);
+        for(size_t i = 0; i < count; i++) {
+            Generate(random, out.Buffer());
+            out.Push();
+        }
+    }
+
+    inline void MarkovChainGenerator::Generate(Random& random, std::string& str) const {
+        // Appends a name to `str`.
+        if(m_Plan.isActive) {
+            GenerateConstrained(random, str);
+            return;
+        }
+        size_t lastLength = str.size();
+        bool isEnded = false;
+        uint32_t context = m_Model.start;
+        const uint32_t* offsets = m_Model.offsets.data();
+        const MarkovModel::Edge* edges = m_Model.edges.data();
+        const uint32_t* symbols = m_Model.symbols.data();
+        const size_t maxLength = m_Constraints.maxLength + 1;
+#ifdef NAGE_METRICS
+        uint64_t fallbacks = 0;
+#endif
+
+        for(size_t i = 0; i < maxLength; i++) {
+            // Determine which character has been picked from the alias table of the context,
+            // escaping to shorter contexts with smoothing.
+            const MarkovModel::Edge* edge;
+            uint32_t level = context;
+            while(true) {
+                // Pick a random value between 0 and 1.
+                double r = random.NextDouble();
+                uint32_t begin = offsets[level];
+                uint32_t count = offsets[level+1] - begin;
+                double x = r * count;
+                uint32_t bucket = std::min((uint32_t) x, count - 1);
+                edge = &edges[begin + bucket];
+                if(x - bucket >= edge->probability)
+                    edge = &edges[begin + edge->alias];
+                if(edge->symbol != MarkovModel::ESCAPE)
+                    break;
+                level = edge->next;
+#ifdef NAGE_METRICS
+                fallbacks++;
+#endif
+            }
+
+            if(edge->symbol == m_Model.end) {
+                isEnded = true;
+                break;
+            }
+
+            lastLength = str.size();
+            string::Encode(symbols[edge->symbol], str);
+            context = level == context ? edge->next : m_Model.FindNext(context, level, edge - edges);
+            if(context == MarkovModel::NONE) {
+                isEnded = true;
+                break;
+            }
+#ifdef NAGE_METRICS
+            // The context is the longest suffix kept in the model, shorter ones back off.
+            fallbacks += m_Model.lengths[context] < std::min<size_t>(m_Model.order, i + 2);
+#endif
+        }
+        NAGE_METRIC(this, FALLBACKS, fallbacks);
+
+        // Like 'End of Text', the last character is dropped when the maximum length is reached.
+        if(!isEnded)
+            str.resize(lastLength);
+    }
+
+    inline void MarkovChainGenerator::GenerateConstrained(Random& random, std::string& str) const {
+        if(m_Plan.context == MarkovModel::NONE)
+            return;
+        str += m_Plan.prefix;
+        uint32_t context = m_Plan.context;
+        uint32_t length = m_Plan.length;
+        uint32_t state = m_Plan.state;
+        uint32_t mask = m_Plan.mask;
+
+        while(true) {
+            double r = random.NextDouble() * GetWeight(context, length, state, mask);
+            uint32_t symbol = MarkovModel::NONE;
+            uint32_t next = MarkovModel::NONE;
+            ForEachSuccessor(context, [&](uint32_t s, double p, uint32_t n) {
+                double weight = p * GetSuccessorWeight(s, n, length, state, mask);
+                if(weight <= 0 || r < 0)
+                    return;
+                symbol = s;
+                next = n;
+                r -= weight;
+            });
+
+            if(symbol == MarkovModel::NONE || symbol == m_Model.end)
+                return;
+            string::Encode(m_Model.symbols[symbol], str);
+            state = m_Plan.transitions[state * m_Plan.symbolCount + symbol];
+            mask |= m_Plan.bits[symbol];
+            length++;
+            context = next;
+            if(context == MarkovModel::NONE)
+                return;
+        }
+    }
+
+    inline void MarkovChainGenerator::BuildPlan() {
+        // Patterns are decoded to symbol ids; a character missing from the chain makes a
+        // required character, prefix or suffix impossible and a forbidden one irrelevant.
+        const MarkovConstraints& constraints = m_Constraints;
+        Plan plan;
+        plan.isActive = true;
+        plan.minLength = constraints.minLength;
+        plan.maxLength = constraints.maxLength;
+        plan.symbolCount = m_Model.symbols.size();
+        plan.bits.assign(plan.symbolCount, 0);
+        m_Plan = plan;
+        if(m_Model.Empty())
+            return;
+
+        bool isSatisfiable = true;
+        auto decode = [&](const std::string& str, std::vector<uint32_t>& ids) {
+            ids.clear();
+            for(size_t i = 0; i < str.length();) {
+                uint32_t id = FindSymbol(string::Decode(str.data(), str.length(), i));
+                if(id == MarkovModel::NONE)
+                    return false;
+                ids.push_back(id);
+            }
+            return true;
+        };
+
+        std::vector<uint32_t> prefix, suffix, ids;
+        isSatisfiable &= decode(constraints.prefix, prefix);
+        isSatisfiable &= decode(constraints.suffix, suffix);
+        std::vector<std::vector<uint32_t>> forbidden;
+        for(size_t i = 0; i < constraints.forbidden.length();) {
+            uint32_t id = FindSymbol(string::Decode(constraints.forbidden.data(), constraints.forbidden.length(), i));
+            if(id != MarkovModel::NONE)
+                forbidden.push_back({id});
+        }
+        for(auto& substring : constraints.forbiddenSubstrings) {
+            if(!substring.empty() && decode(substring, ids))
+                forbidden.push_back(ids);
+        }
+        size_t required = 0;
+        for(size_t i = 0; i < constraints.required.length();) {
+            uint32_t id = FindSymbol(string::Decode(constraints.required.data(), constraints.required.length(), i));
+            if(id == MarkovModel::NONE) {
+                isSatisfiable = false;
+                break;
+            }
+            if(m_Plan.bits[id] != 0)
+                continue;
+            if(required == MAX_REQUIRED)
+                throw std::invalid_argument("nage: too many required characters");
+            m_Plan.bits[id] = 1u << required++;
+        }
+        m_Plan.fullMask = (uint32_t) ((1ull << required) - 1);
+        if(!isSatisfiable)
+            return;
+
+        // Aho-Corasick automaton over the suffix and the forbidden substrings, with a full
+        // transition table since both the patterns and the alphabet are small.
+        std::vector<std::map<uint32_t, uint32_t>> children(1);
+        std::vector<uint8_t> flags(1, 0);
+        auto insert = [&](const std::vector<uint32_t>& pattern, uint8_t flag) {
+            uint32_t node = 0;
+            for(uint32_t id : pattern) {
+                auto it = children[node].find(id);
+                if(it == children[node].end()) {
+                    if(children.size() == MAX_PATTERN_STATES)
+                        throw std::invalid_argument("nage: constraint patterns are too long");
+                    it = children[node].emplace(id, children.size()).first;
+                    children.emplace_back();
+                    flags.push_back(0);
+                }
+                node = it->second;
+            }
+            flags[node] |= flag;
+        };
+        if(!suffix.empty())
+            insert(suffix, Plan::SUFFIX);
+        for(auto& pattern : forbidden)
+            insert(pattern, Plan::DEAD);
+
+        size_t n = plan.symbolCount;
+        m_Plan.transitions.assign(children.size() * n, 0);
+        std::vector<uint32_t> failures(children.size(), 0);
+        std::deque<uint32_t> queue;
+        for(auto& [id, child] : children[0]) {
+            m_Plan.transitions[id] = child;
+            queue.push_back(child);
+        }
+        while(!queue.empty()) {
+            uint32_t node = queue.front();
+            queue.pop_front();
+            flags[node] |= flags[failures[node]];
+            for(size_t id = 0; id < n; id++)
+                m_Plan.transitions[node * n + id] = m_Plan.transitions[failures[node] * n + id];
+            for(auto& [id, child] : children[node]) {
+                failures[child] = m_Plan.transitions[failures[node] * n + id];
+                m_Plan.transitions[node * n + id] = child;
+                queue.push_back(child);
+            }
+        }
+        m_Plan.flags = flags;
+
+        // Walk the prefix, then weigh every state reachable from there.
+        uint32_t context = m_Model.start;
+        uint32_t state = 0;
+        uint32_t mask = 0;
+        for(uint32_t id : prefix) {
+            uint32_t next = MarkovModel::NONE;
+            bool isFound = false;
+            ForEachSuccessor(context, [&](uint32_t symbol, double p, uint32_t n) {
+                if(symbol == id && p > 0 && !isFound) {
+                    next = n;
+                    isFound = true;
+                }
+            });
+            state = m_Plan.transitions[state * n + id];
+            mask |= m_Plan.bits[id];
+            if(!isFound || next == MarkovModel::NONE || (m_Plan.flags[state] & Plan::DEAD))
+                return;
+            context = next;
+        }
+        if(prefix.size() > constraints.maxLength)
+            return;
+
+        // Every layer is weighed, which bounds the plan by the product of its dimensions.
+        m_Plan.length = prefix.size();
+        m_Plan.stateCount = children.size();
+        m_Plan.maskCount = (size_t) m_Plan.fullMask + 1;
+        size_t size = constraints.maxLength - prefix.size() + 1;
+        for(size_t dimension : {m_Model.ContextCount(), m_Plan.stateCount, m_Plan.maskCount}) {
+            if(size > MAX_PLAN_WEIGHTS / dimension)
+                throw std::invalid_argument("nage: constraints need too large a plan");
+            size *= dimension;
+        }
+        m_Plan.weights.assign(size, 0);
+        Weigh();
+        if(GetWeight(context, prefix.size(), state, mask) <= 0) {
+            m_Plan.weights = std::vector<double>();
+            return;
+        }
+        m_Plan.prefix = constraints.prefix;
+        m_Plan.context = context;
+        m_Plan.length = prefix.size();
+        m_Plan.state = state;
+        m_Plan.mask = mask;
+    }
+
+    inline void MarkovChainGenerator::Weigh() {
+        // Layers are weighed from the maximum length down, each from the one after it.
+        // Successors are enumerated once per context and applied to all its states.
+        size_t states = m_Plan.stateCount;
+        size_t masks = m_Plan.maskCount;
+        size_t cells = states * masks;
+        size_t layerSize = m_Model.ContextCount() * cells;
+        for(size_t length = m_Plan.maxLength + 1; length-- > m_Plan.length;) {
+            double* layer = &m_Plan.weights[(length - m_Plan.length) * layerSize];
+            for(uint32_t context = 0; context < m_Model.ContextCount(); context++) {
+                double* weights = layer + context * cells;
+                ForEachSuccessor(context, [&](uint32_t symbol, double p, uint32_t next) {
+                    if(symbol == m_Model.end) {
+                        for(uint32_t state = 0; state < states; state++) {
+                            for(uint32_t mask = 0; mask < masks; mask++)
+                                weights[state * masks + mask] += p * IsAccepted(length, state, mask);
+                        }
+                        return;
+                    }
+                    if(length + 1 > m_Plan.maxLength)
+                        return;
+                    const double* nextWeights = next == MarkovModel::NONE ? nullptr : layer + layerSize + next * cells;
+                    for(uint32_t state = 0; state < states; state++) {
+                        uint32_t nextState = m_Plan.transitions[state * m_Plan.symbolCount + symbol];
+                        if(m_Plan.flags[nextState] & Plan::DEAD)
+                            continue;
+                        for(uint32_t mask = 0; mask < masks; mask++) {
+                            uint32_t nextMask = mask | m_Plan.bits[symbol];
+                            if(nextWeights == nullptr)
+                                weights[state * masks + mask] += p * IsAccepted(length + 1, nextState, nextMask);
+                            else
+                                weights[state * masks + mask] += p * nextWeights[nextState * masks + nextMask];
+                        }
+                    }
+                });
+            }
+        }
+    }
+
+    inline double MarkovChainGenerator::GetWeight(uint32_t context, uint32_t length, uint32_t state, uint32_t mask) const {
+        if(length < m_Plan.length || length > m_Plan.maxLength || m_Plan.weights.empty())
+            return 0;
+        size_t layer = (length - m_Plan.length) * m_Model.ContextCount() + context;
+        return m_Plan.weights[(layer * m_Plan.stateCount + state) * m_Plan.maskCount + mask];
+    }
+
+    inline double MarkovChainGenerator::GetSuccessorWeight(uint32_t symbol, uint32_t next, uint32_t length, uint32_t state, uint32_t mask) const {
+        // Same cases as Weigh(), reading the weights it computed.
+        if(symbol == m_Model.end)
+            return IsAccepted(length, state, mask);
+        uint32_t nextState = m_Plan.transitions[state * m_Plan.symbolCount + symbol];
+        uint32_t nextMask = mask | m_Plan.bits[symbol];
+        if(length + 1 > m_Plan.maxLength || (m_Plan.flags[nextState] & Plan::DEAD))
+            return 0;
+        if(next == MarkovModel::NONE)
+            return IsAccepted(length + 1, nextState, nextMask);
+        return GetWeight(next, length + 1, nextState, nextMask);
+    }
+
+    inline bool MarkovChainGenerator::IsAccepted(uint32_t length, uint32_t state, uint32_t mask) const {
+        if(length < m_Plan.minLength || length > m_Plan.maxLength || mask != m_Plan.fullMask)
+            return false;
+        return m_Constraints.suffix.empty() || (m_Plan.flags[state] & Plan::SUFFIX);
+    }
+
+    template<typename F>
+    inline void MarkovChainGenerator::ForEachSuccessor(uint32_t context, F&& func) const {
+        // Calls func(symbol, probability, next context) for the successors of the context and,
+        // through escapes, of its back-off contexts. A symbol may thus come several times,
+        // the probabilities of its occurrences adding up.
+        double mass = 1;
+        for(uint32_t level = context; level != MarkovModel::NONE;) {
+            uint32_t begin = m_Model.offsets[level];
+            uint32_t end = m_Model.offsets[level+1];
+            bool isEscaping = m_Model.edges[end - 1].symbol == MarkovModel::ESCAPE;
+            double discount = isEscaping ? m_Model.smoothing.discount : 0;
+            double total = m_Model.GetTotal(level);
+            for(uint32_t edge = begin; edge < end - isEscaping; edge++) {
+                const MarkovModel::Edge& e = m_Model.edges[edge];
+                uint32_t next = level == context ? e.next : m_Model.FindNext(context, level, edge);
+                func(e.symbol, mass * (e.count - discount) / total, next);
+            }
+            if(!isEscaping)
+                break;
+            mass *= discount * (end - 1 - begin) / total;
+            level = m_Model.edges[end - 1].next;
+        }
+    }
+
+    inline uint32_t MarkovChainGenerator::FindSymbol(uint32_t codePoint) const {
+        // Symbols are interned in code point order.
+        auto it = std::lower_bound(m_Model.symbols.begin(), m_Model.symbols.end(), codePoint);
+        if(it == m_Model.symbols.end() || *it != codePoint)
+            return MarkovModel::NONE;
+        return it - m_Model.symbols.begin();
+    }
+
+    inline bool MarkovChainGenerator::Load(const std::string& fileName, bool isVerified) {
+        MarkovModel model;
+        file::Fingerprint source;
+        uint64_t checksum;
+        if(!model.Load(fileName, source, &checksum, isVerified) || model.order != m_Order || model.smoothing.minCount != m_Smoothing.minCount
+            || model.smoothing.discount != m_Smoothing.discount)
+            return false;
+        m_Model = std::move(model);
+        m_Source = source;
+        m_Checksum = checksum;
+        m_Counts.Clear();
+        m_HasCounts = false;
+        m_Pending.clear();
+        m_IsSourceChanged = false;
+        ReadLog(fileName + ".log", true);
+        if(m_Plan.isActive)
+            BuildPlan();
+        return true;
+    }
+
+    inline bool MarkovChainGenerator::Save(const std::string& fileName) {
+        // Writes the whole model, which also compacts the delta log.
+        if(!m_Model.Save(fileName, m_Source, &m_Checksum))
+            return false;
+        std::error_code error;
+        std::filesystem::remove(fileName + ".log", error);
+        m_Pending.clear();
+        m_IsSourceChanged = false;
+        return true;
+    }
+
+    inline void MarkovChainGenerator::Add(std::string_view line) {
+        NGramCounter added(m_Order), removed(m_Order);
+        added.AddLine(line);
+        m_Pending.emplace_back(1, std::string(line));
+        Apply(added, removed);
+    }
+
+    inline void MarkovChainGenerator::Remove(std::string_view line) {
+        NGramCounter added(m_Order), removed(m_Order);
+        removed.AddLine(line);
+        m_Pending.emplace_back(-1, std::string(line));
+        Apply(added, removed);
+    }
+
+    inline void MarkovChainGenerator::Update(const std::vector<std::string>& added, const std::vector<std::string>& removed) {
+        NGramCounter addedCounts(m_Order), removedCounts(m_Order);
+        for(auto& line : added) {
+            addedCounts.AddLine(line);
+            m_Pending.emplace_back(1, line);
+        }
+        for(auto& line : removed) {
+            removedCounts.AddLine(line);
+            m_Pending.emplace_back(-1, line);
+        }
+        Apply(addedCounts, removedCounts);
+    }
+
+    inline bool MarkovChainGenerator::SaveUpdates(const std::string& cacheFileName) {
+        // Appends the pending updates to the delta log of the cache, the whole cache is
+        // written instead when it is not the one this model was loaded from or saved to,
+        // or when the log grew past COMPACTION_RATIO of the cache.
+        if(m_Pending.empty() && !m_IsSourceChanged)
+            return true;
+        std::error_code error;
+        std::string logFileName = cacheFileName + ".log";
+        MarkovModel::Header header;
+        {
+            std::ifstream cache(cacheFileName, std::ios::binary);
+            if(!cache || !cache.read((char*) &header, sizeof(header)) || header.checksum != m_Checksum)
+                return Save(cacheFileName);
+        }
+
+        size_t size = ReadLog(logFileName, false);
+        if(size == 0) {
+            std::ofstream file(logFileName, std::ios::binary | std::ios::trunc);
+            LogHeader logHeader = {};
+            memcpy(logHeader.magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+            logHeader.version = MarkovModel::VERSION;
+            logHeader.base = m_Checksum;
+            if(!file.write((const char*) &logHeader, sizeof(logHeader)))
+                return false;
+        }
+        else if(std::filesystem::file_size(logFileName, error) != size) {
+            // Drop a record torn by an interrupted write.
+            std::filesystem::resize_file(logFileName, size, error);
+        }
+
+        std::ofstream file(logFileName, std::ios::binary | std::ios::app);
+        auto append = [&](uint32_t type, int64_t count, const void* data, size_t size) {
+            LogRecord record = {type, (uint32_t) size, count, file::Hash(data, size)};
+            file.write((const char*) &record, sizeof(record));
+            file.write((const char*) data, size);
+        };
+        for(auto& [count, line] : m_Pending)
+            append(LOG_LINE, count, line.data(), line.size());
+        if(m_IsSourceChanged)
+            append(LOG_SOURCE, 0, &m_Source, sizeof(m_Source));
+        file.close();
+        if(!file)
+            return false;
+        m_Pending.clear();
+        m_IsSourceChanged = false;
+
+        if(std::filesystem::file_size(logFileName, error) * COMPACTION_RATIO > std::filesystem::file_size(cacheFileName, error))
+            return Save(cacheFileName);
+        return true;
+    }
+
+    inline void MarkovChainGenerator::Compute(const std::string& fileName) {
+        Compute(fileName, GetThreadPool());
+    }
+
+    inline void MarkovChainGenerator::Compute(const std::string& fileName, ThreadPool& pool) {
+        // The mapped corpus is cut in chunks of whole lines counted in parallel. Each worker
+        // borrows a counter, so at most one counter per thread exists and memory only grows
+        // with the number of distinct n-grams, never with the corpus.
+        file::MappedFile file(fileName, true);
+        if(!file.IsOpen())
+            return;
+        file::GetFingerprint(fileName, m_Source);
+
+        const size_t chunkSize = 1 << 20;
+        std::vector<size_t> bounds = {0};
+        while(bounds.back() < file.Size()) {
+            size_t bound = std::min(bounds.back() + chunkSize, file.Size());
+            const char* newline = (const char*) memchr(file.Data() + bound, '\n', file.Size() - bound);
+            bounds.push_back(newline ? newline - file.Data() + 1 : file.Size());
+        }
+
+        std::vector<std::unique_ptr<NGramCounter>> counters;
+        std::vector<NGramCounter*> available;
+        std::mutex mutex;
+        pool.ForEach(bounds.size() - 1, [&](size_t chunk) {
+            NGramCounter* counter;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(available.empty()) {
+                    counters.push_back(std::make_unique<NGramCounter>(m_Order));
+                    available.push_back(counters.back().get());
+                }
+                counter = available.back();
+                available.pop_back();
+            }
+
+            const char* data = file.Data();
+            for(size_t begin = bounds[chunk]; begin < bounds[chunk + 1];) {
+                const char* newline = (const char*) memchr(data + begin, '\n', bounds[chunk + 1] - begin);
+                size_t end = newline ? newline - data : bounds[chunk + 1];
+                counter->AddLine(std::string_view(data + begin, end - begin));
+                begin = end + 1;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            available.push_back(counter);
+        });
+
+        m_Counts.Clear();
+        for(auto& other : counters) {
+            if(m_Counts.Size() == 0)
+                std::swap(m_Counts, *other);
+            else
+                m_Counts.Merge(*other);
+            other.reset();
+        }
+        m_HasCounts = true;
+        m_Pending.clear();
+        m_IsSourceChanged = false;
+        Compile(m_Counts);
+        m_Model.ClearIndex();
+    }
+
+    inline void MarkovChainGenerator::Compile(const NGramCounter& counter) {
+        m_Model.Clear();
+        m_Model.order = m_Order;
+        m_Model.smoothing = m_Smoothing;
+        size_t stride = counter.Stride();
+        std::vector<uint32_t> sorted = counter.Sort();
+
+        // Intern every code point appearing in the chain, ids are given in code point order.
+        std::vector<uint32_t> codePoints;
+        for(size_t i = 0; i < counter.Size(); i++) {
+            const uint32_t* entry = counter.Entry(i);
+            if(entry[stride - 1] == 0)
+                continue;
+            codePoints.insert(codePoints.end(), entry + 1, entry + 1 + entry[0]);
+            codePoints.push_back(entry[m_Order + 1]);
+        }
+        std::sort(codePoints.begin(), codePoints.end());
+        codePoints.erase(std::unique(codePoints.begin(), codePoints.end()), codePoints.end());
+        m_Model.symbols.assign(codePoints.data(), codePoints.data() + codePoints.size());
+        auto intern = [&](uint32_t codePoint) {
+            return (uint32_t) (std::lower_bound(codePoints.begin(), codePoints.end(), codePoint) - codePoints.begin());
+        };
+        if(std::binary_search(codePoints.begin(), codePoints.end(), '\003'))
+            m_Model.end = intern('\003');
+
+        // Pack contexts and their successors in canonical order. Contexts seen less than
+        // `minCount` times are pruned: a suffix is seen at least as often as the contexts
+        // ending with it, so that the suffixes of a kept context are kept.
+        std::vector<uint32_t> ids(m_Order);
+        m_Model.offsets.push_back(0);
+        for(size_t i = 0; i < sorted.size();) {
+            const uint32_t* first = counter.Entry(sorted[i]);
+            size_t j = i;
+            uint64_t total = 0;
+            for(; j < sorted.size(); j++) {
+                const uint32_t* entry = counter.Entry(sorted[j]);
+                if(memcmp(entry, first, (m_Order + 1) * sizeof(uint32_t)) != 0)
+                    break;
+                total += entry[stride - 1];
+            }
+            if(total == 0 || (first[0] > 1 && total < m_Smoothing.minCount)) {
+                i = j;
+                continue;
+            }
+
+            for(size_t k = 0; k < (size_t) m_Order; k++)
+                ids[k] = k < first[0] ? intern(first[k + 1]) : MarkovModel::NONE;
+            m_Model.contexts.append(ids.data(), ids.data() + ids.size());
+            m_Model.lengths.push_back(first[0]);
+
+            for(; i < j; i++) {
+                const uint32_t* entry = counter.Entry(sorted[i]);
+                if(entry[stride - 1] == 0)
+                    continue;
+                m_Model.edges.push_back({0, 0, intern(entry[m_Order + 1]), MarkovModel::NONE, entry[stride - 1]});
+            }
+            if(first[0] > 1 && m_Smoothing.discount > 0)
+                m_Model.edges.push_back({0, 0, MarkovModel::ESCAPE, MarkovModel::NONE, 0});
+            m_Model.offsets.push_back(m_Model.edges.size());
+        }
+
+        m_Model.BuildTable();
+        m_Model.BuildTransitions();
+        if(std::binary_search(codePoints.begin(), codePoints.end(), '\002')) {
+            uint32_t start = intern('\002');
+            m_Model.start = m_Model.Find(&start, 1);
+        }
+        if(m_Model.start == MarkovModel::NONE) {
+            m_Model.Clear();
+        }
+        else {
+            m_Model.RemoveUnreachable();
+            m_Model.BuildAliases();
+        }
+
+        // The counts of pruned contexts cannot be restored from the model: keep what the
+        // model lacks, so that updates and smoothing changes of a loaded model see every count.
+        if(m_Smoothing.minCount > 1 && !m_Model.Empty()) {
+            NGramCounter restored(m_Order);
+            RestoreCounts(restored);
+            for(size_t i = 0; i < counter.Size(); i++) {
+                const uint32_t* entry = counter.Entry(i);
+                uint32_t count = restored.Count(entry + 1, entry[0], entry[m_Order + 1]);
+                if(entry[stride - 1] <= count)
+                    continue;
+                m_Model.pruned.append(entry, entry + stride - 1);
+                m_Model.pruned.push_back(entry[stride - 1] - count);
+            }
+        }
+        if(m_Plan.isActive)
+            BuildPlan();
+    }
+
+    inline void MarkovChainGenerator::LoadCacheOrCompute(const std::string& cacheFileName, const std::string& fileName, bool isVerified) {
+        // The cache is rebuilt when it is missing, invalid (corrupt when `isVerified`), of
+        // another order or when the source list changed since it was computed. Without a
+        // source list, any valid cache is used and none is written. Lines appended to the
+        // source list are added to the cache incrementally.
+        if(Load(cacheFileName, isVerified)) {
+            if(!std::filesystem::exists(fileName) || file::IsSameSource(m_Source, fileName))
+                return;
+            if(AddSourceTail(fileName)) {
+                SaveUpdates(cacheFileName);
+                return;
+            }
+        }
+        if(!std::filesystem::exists(fileName))
+            return;
+        Compute(fileName);
+        if(!m_Model.Empty())
+            Save(cacheFileName);
+    }
+
+    inline void MarkovChainGenerator::Apply(const NGramCounter& added, const NGramCounter& removed) {
+        // Counts of existing edges are patched in place and only their contexts are
+        // rebuilt. New symbols, contexts or edges, edges dropping to 0 and contexts crossing
+        // the pruning threshold change the layout of the model, which is then compiled again
+        // from the counts. Without smoothing, contexts which are neither full-length nor
+        // starting a name are never kept and only counted.
+        LoadCounts();
+        size_t stride = m_Counts.Stride();
+        for(const NGramCounter* delta : {&added, &removed}) {
+            for(size_t i = 0; i < delta->Size(); i++) {
+                const uint32_t* entry = delta->Entry(i);
+                int64_t count = entry[stride - 1];
+                m_Counts.Add(entry + 1, entry[0], entry[m_Order + 1], delta == &added ? count : -count);
+            }
+        }
+
+        bool isCompiling = m_Model.Empty();
+        bool isSmoothed = m_Smoothing.minCount > 1 || m_Smoothing.discount > 0;
+        std::vector<uint32_t> touched, ids(m_Order);
+        for(const NGramCounter* delta : {&added, &removed}) {
+            for(size_t i = 0; i < delta->Size() && !isCompiling; i++) {
+                const uint32_t* entry = delta->Entry(i);
+                for(size_t k = 0; k < entry[0] && !isCompiling; k++) {
+                    ids[k] = FindSymbol(entry[k + 1]);
+                    isCompiling = ids[k] == MarkovModel::NONE;
+                }
+                uint32_t symbol = FindSymbol(entry[m_Order + 1]);
+                uint32_t context = isCompiling ? MarkovModel::NONE : m_Model.Find(ids.data(), entry[0]);
+                uint32_t count = m_Counts.Count(entry + 1, entry[0], entry[m_Order + 1]);
+                if(context == MarkovModel::NONE && !isCompiling && !isSmoothed && entry[0] < (uint32_t) m_Order && entry[1] != '\002')
+                    continue;
+                if(context == MarkovModel::NONE || symbol == MarkovModel::NONE || count == 0) {
+                    isCompiling = true;
+                    break;
+                }
+
+                uint32_t edge = m_Model.FindEdge(context, symbol);
+                if(edge == MarkovModel::NONE) {
+                    isCompiling = true;
+                    break;
+                }
+                m_Model.edges[edge].count = count;
+                touched.push_back(context);
+            }
+        }
+
+        std::sort(touched.begin(), touched.end());
+        touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+        for(size_t i = 0; i < touched.size() && !isCompiling; i++)
+            isCompiling = m_Model.lengths[touched[i]] > 1 && m_Model.GetTotal(touched[i]) < m_Smoothing.minCount;
+        if(isCompiling) {
+            Compile(m_Counts);
+            return;
+        }
+        for(uint32_t context : touched)
+            m_Model.BuildAliases(context);
+        if(m_Plan.isActive)
+            BuildPlan();
+    }
+
+    inline void MarkovChainGenerator::LoadCounts() {
+        // Counts of a loaded model are only indexed when it is first updated.
+        if(!m_Model.IsIndexed())
+            m_Model.BuildIndex();
+        if(m_HasCounts)
+            return;
+        m_Counts = NGramCounter(m_Order);
+        RestoreCounts(m_Counts);
+        const Array<uint32_t>& pruned = m_Model.pruned;
+        size_t stride = m_Counts.Stride();
+        for(size_t i = 0; i + stride <= pruned.size(); i += stride)
+            m_Counts.Add(&pruned[i + 1], pruned[i], pruned[i + m_Order + 1], pruned[i + stride - 1]);
+        m_HasCounts = true;
+    }
+
+    inline void MarkovChainGenerator::RestoreCounts(NGramCounter& counts) const {
+        // Counts of the indexed model. The counts of a context are also the ones of its
+        // suffixes down to the next kept one, which restores the counts of the contexts
+        // pruned as unreachable. Those of contexts pruned below `minCount` are kept apart.
+        std::vector<uint32_t> codePoints(m_Order);
+        for(uint32_t context = 0; context < m_Model.ContextCount(); context++) {
+            uint32_t length = m_Model.lengths[context];
+            const uint32_t* ids = &m_Model.contexts[(size_t) context * m_Order];
+            for(uint32_t k = 0; k < length; k++)
+                codePoints[k] = m_Model.symbols[ids[k]];
+            uint32_t suffix = 1;
+            while(suffix < length && m_Model.Find(ids + suffix, length - suffix) == MarkovModel::NONE)
+                suffix++;
+            for(uint32_t edge = m_Model.offsets[context]; edge < m_Model.offsets[context+1]; edge++) {
+                const MarkovModel::Edge& e = m_Model.edges[edge];
+                if(e.symbol == MarkovModel::ESCAPE)
+                    continue;
+                for(uint32_t k = 0; k < suffix; k++)
+                    counts.Add(codePoints.data() + k, length - k, m_Model.symbols[e.symbol], e.count);
+            }
+        }
+    }
+
+    inline size_t MarkovChainGenerator::ReadLog(const std::string& fileName, bool isReplaying) {
+        // Returns the size of the valid part of the log, 0 when it does not belong to the
+        // current cache. Replaying stops at the first torn or corrupt record.
+        file::MappedFile file(fileName);
+        if(!file.IsOpen() || file.Size() < sizeof(LogHeader))
+            return 0;
+        LogHeader header;
+        memcpy(&header, file.Data(), sizeof(header));
+        if(memcmp(header.magic, LOG_MAGIC, sizeof(LOG_MAGIC)) != 0 || header.version != MarkovModel::VERSION || header.base != m_Checksum)
+            return 0;
+
+        NGramCounter added(m_Order), removed(m_Order);
+        size_t offset = sizeof(LogHeader);
+        while(offset + sizeof(LogRecord) <= file.Size()) {
+            LogRecord record;
+            memcpy(&record, file.Data() + offset, sizeof(record));
+            const char* data = file.Data() + offset + sizeof(record);
+            if(record.size > file.Size() - offset - sizeof(record) || file::Hash(data, record.size) != record.checksum)
+                break;
+            if(record.type == LOG_SOURCE && record.size == sizeof(file::Fingerprint))
+                memcpy(&m_Source, data, sizeof(m_Source));
+            else if(record.type == LOG_LINE && record.count > 0)
+                added.AddLine(std::string_view(data, record.size), record.count);
+            else if(record.type == LOG_LINE)
+                removed.AddLine(std::string_view(data, record.size), -record.count);
+            offset += sizeof(record) + record.size;
+        }
+
+        if(isReplaying && (added.Size() > 0 || removed.Size() > 0))
+            Apply(added, removed);
+        return offset;
+    }
+
+    inline bool MarkovChainGenerator::AddSourceTail(const std::string& fileName) {
+        // The source list only had lines appended when its former content is unchanged.
+        file::MappedFile file(fileName);
+        if(!file.IsOpen() || m_Source.size == 0 || file.Size() <= m_Source.size)
+            return false;
+        if(file.Data()[m_Source.size - 1] != '\n' || file::Hash(file.Data(), m_Source.size) != m_Source.hash)
+            return false;
+
+        std::vector<std::string> lines;
+        for(size_t begin = m_Source.size; begin < file.Size();) {
+            const char* newline = (const char*) memchr(file.Data() + begin, '\n', file.Size() - begin);
+            size_t end = newline ? newline - file.Data() : file.Size();
+            lines.emplace_back(file.Data() + begin, end - begin);
+            begin = end + 1;
+        }
+        Update(lines, {});
+        file::GetFingerprint(fileName, m_Source);
+        m_IsSourceChanged = true;
+        return true;
+    }
+
+    /***********************************************************
+    *                   COMPILED TEMPLATE                      *
+    ***********************************************************/
+
+    inline CompiledTemplate::CompiledTemplate() {
+        m_Root = 0;
+    }
+
+    inline bool CompiledTemplate::Empty() const {
+        return m_Nodes.empty();
+    }
+
+    inline uint64_t CompiledTemplate::Cardinality() const {
+        return m_Counts.empty() ? 0 : m_Counts[m_Root];
+    }
+
+    /***********************************************************
+    *                   TEMPLATE GENERATOR                     *
+    ***********************************************************/
+
+    inline TemplateGenerator::TemplateGenerator() {
+        m_Offsets.push_back(0);
+    }
+    
+    inline TemplateGenerator::TemplateGenerator(const std::string& fileName) : TemplateGenerator() {
+        LoadTemplates(fileName);
+    }
+        
+    inline std::string TemplateGenerator::Generate(std::string expr) {
+        return Generate(Compile(expr));
+    }
+
+    inline std::string TemplateGenerator::Generate(const CompiledTemplate& compiled) {
+        std::string str;
+        GenerateInto(compiled, str);
+        return str;
+    }
+
+    inline std::string TemplateGenerator::Generate() {
+        return Generate(GetDefault());
+    }
+
+    inline void TemplateGenerator::GenerateInto(std::string& out) {
+        GenerateInto(GetDefault(), out);
+    }
+
+    inline void TemplateGenerator::GenerateN(size_t count, NameTable& out) {
+        GenerateN(GetDefault(), count, out);
+    }
+
+    inline void TemplateGenerator::GenerateInto(const CompiledTemplate& compiled, std::string& out) {
+        NAGE_METRICS_SCOPE(1, &out);
+        out.clear();
+        if(!compiled.Empty())
+            Evaluate(compiled, compiled.m_Root, GetRandom(), out);
+#ifdef NAGE_METRICS
+        RecordDepth(DepthScope::TakeMaximum());
+#endif
+    }
+
+    inline void TemplateGenerator::GenerateN(const CompiledTemplate& compiled, size_t count, NameTable& out) {
+        NAGE_METRICS_SCOPE(count, &out.Buffer());
+        Random& random = GetRandom();
+        out.Reserve(count, count * 8);
+        for(size_t i = 0; i < count; i++) {
+            if(!compiled.Empty())
+                Evaluate(compiled, compiled.m_Root, random, out.Buffer());
+            out.Push();
+#ifdef NAGE_METRICS
+            RecordDepth(DepthScope::TakeMaximum());
+#endif
+        }
+    }
+
+    inline void TemplateGenerator::GenerateAt(const CompiledTemplate& compiled, uint64_t rank, std::string& out) {
+        // Names are ranked like numbers whose digits are the picks of the template, the
+        // first one being the least significant. Ranks from Cardinality() on give empty names.
+        NAGE_METRICS_SCOPE(1, &out);
+        out.clear();
+        if(rank < compiled.Cardinality())
+            EvaluateAt(compiled, compiled.m_Root, rank, out);
+#ifdef NAGE_METRICS
+        RecordDepth(DepthScope::TakeMaximum());
+#endif
+    }
+
+    inline void TemplateGenerator::GenerateUniformInto(const CompiledTemplate& compiled, std::string& out) {
+        // Unlike GenerateInto(), which picks alternatives and values as written, every one of
+        // the Cardinality() names is equally likely.
+        NAGE_METRICS_SCOPE(1, &out);
+        out.clear();
+        if(!compiled.Empty())
+            EvaluateUniform(compiled, compiled.m_Root, GetRandom(), out);
+#ifdef NAGE_METRICS
+        RecordDepth(DepthScope::TakeMaximum());
+#endif
+    }
+
+    inline void TemplateGenerator::SetTemplate(const std::string& expr) {
+        m_Template = expr;
+        m_Default = expr.empty() ? nullptr : std::make_unique<CompiledTemplate>(Compile(expr));
+    }
+
+    inline const std::string& TemplateGenerator::GetTemplate() const {
+        return m_Template;
+    }
+
+    inline const CompiledTemplate& TemplateGenerator::GetDefault() const {
+        if(m_Default == nullptr)
+            throw std::logic_error("nage: template generator has no default template, see SetTemplate()");
+        return *m_Default;
+    }
+
+    inline CompiledTemplate TemplateGenerator::Compile(const std::string& expr) const {
+        CompiledTemplate compiled;
+        size_t i = 0;
+        compiled.m_Root = Compile(compiled, expr, i, false);
+        Count(compiled);
+        return compiled;
+    }
+
+    inline uint32_t TemplateGenerator::Compile(CompiledTemplate& compiled, const std::string& expr, size_t& i, bool isLiteral) const {
+        // Same grammar as Evaluate(): '(' opens a literal group, '<' a symbol group, both end
+        // on ')' or '>', '|' separates alternatives. Each group becomes a choice between
+        // sequences, consecutive literal characters are merged into a single node.
+        using Node = CompiledTemplate::Node;
+        using Type = CompiledTemplate::Type;
+
+        std::vector<uint32_t> alternatives;
+        std::vector<uint32_t> sequence;
+
+        auto closeSequence = [&]() {
+            compiled.m_Nodes.push_back({Type::SEQUENCE, (uint32_t) compiled.m_Children.size(), (uint32_t) sequence.size()});
+            compiled.m_Children.insert(compiled.m_Children.end(), sequence.begin(), sequence.end());
+            alternatives.push_back(compiled.m_Nodes.size() - 1);
+            sequence.clear();
+        };
+        auto appendLiteral = [&](const char* str, size_t length) {
+            if(!sequence.empty()) {
+                Node& last = compiled.m_Nodes[sequence.back()];
+                if(last.type == Type::LITERAL && last.begin + last.count == compiled.m_Pool.size()) {
+                    compiled.m_Pool.append(str, length);
+                    last.count += length;
+                    return;
+                }
+            }
+            compiled.m_Nodes.push_back({Type::LITERAL, (uint32_t) compiled.m_Pool.size(), (uint32_t) length});
+            compiled.m_Pool.append(str, length);
+            sequence.push_back(compiled.m_Nodes.size() - 1);
+        };
+
+        while(i < expr.length()) {
+            size_t charLength = std::min(string::CharLength(expr[i]), expr.length() - i);
+            const char* ch = expr.data() + i;
+            i += charLength;
+
+            if(*ch == '(' || *ch == '<') {
+                sequence.push_back(Compile(compiled, expr, i, *ch == '('));
+            }
+            else if(*ch == ')' || *ch == '>') {
+                break;
+            }
+            else if(*ch == '|') {
+                closeSequence();
+            }
+            else if(isLiteral) {
+                // Runs of literal characters end at the next operator, whose bytes never
+                // occur inside a multi-byte UTF-8 character.
+                size_t end = std::min(expr.find_first_of("()<>|", i), expr.length());
+                appendLiteral(ch, end - i + charLength);
+                i = end;
+            }
+            else {
+                const Template* t = FindTemplate(std::string_view(ch, charLength));
+                if(t == nullptr)
+                    continue;
+                compiled.m_Nodes.push_back({Type::SYMBOL, (uint32_t) compiled.m_Symbols.size(), 1});
+                compiled.m_Symbols.push_back(t);
+                sequence.push_back(compiled.m_Nodes.size() - 1);
+            }
+        }
+        closeSequence();
+
+        compiled.m_Nodes.push_back({Type::CHOICE, (uint32_t) compiled.m_Children.size(), (uint32_t) alternatives.size()});
+        compiled.m_Children.insert(compiled.m_Children.end(), alternatives.begin(), alternatives.end());
+        return compiled.m_Nodes.size() - 1;
+    }
+
+    inline void TemplateGenerator::Evaluate(const CompiledTemplate& compiled, uint32_t node, Random& random, std::string& str) const {
+        NAGE_METRICS_DEPTH();
+        const CompiledTemplate::Node& n = compiled.m_Nodes[node];
+        switch(n.type) {
+            case CompiledTemplate::Type::LITERAL:
+                str.append(compiled.m_Pool, n.begin, n.count);
+                break;
+            case CompiledTemplate::Type::SYMBOL: {
+                const Template* t = compiled.m_Symbols[n.begin];
+                str += Sample(*t, random);
+                break;
+            }
+            case CompiledTemplate::Type::SEQUENCE:
+                for(uint32_t i = 0; i < n.count; i++)
+                    Evaluate(compiled, compiled.m_Children[n.begin + i], random, str);
+                break;
+            case CompiledTemplate::Type::CHOICE: {
+                uint32_t i = (n.count > 1) ? random.NextBelow(n.count) : 0;
+                Evaluate(compiled, compiled.m_Children[n.begin + i], random, str);
+                break;
+            }
+        }
+    }
+
+    inline void TemplateGenerator::EvaluateAt(const CompiledTemplate& compiled, uint32_t node, uint64_t rank, std::string& str) const {
+        NAGE_METRICS_DEPTH();
+        const CompiledTemplate::Node& n = compiled.m_Nodes[node];
+        switch(n.type) {
+            case CompiledTemplate::Type::LITERAL:
+                str.append(compiled.m_Pool, n.begin, n.count);
+                break;
+            case CompiledTemplate::Type::SYMBOL:
+                str += Value(compiled.m_Values[compiled.m_ValueStarts[n.begin] + rank]);
+                break;
+            case CompiledTemplate::Type::SEQUENCE:
+                for(uint32_t i = 0; i < n.count; i++) {
+                    uint32_t child = compiled.m_Children[n.begin + i];
+                    uint64_t count = compiled.m_Counts[child];
+                    if(count == 1) {
+                        EvaluateAt(compiled, child, 0, str);
+                        continue;
+                    }
+                    EvaluateAt(compiled, child, rank % count, str);
+                    rank /= count;
+                }
+                break;
+            case CompiledTemplate::Type::CHOICE:
+                for(uint32_t i = 0; i < n.count; i++) {
+                    uint32_t child = compiled.m_Children[n.begin + i];
+                    if(rank < compiled.m_Counts[child]) {
+                        EvaluateAt(compiled, child, rank, str);
+                        break;
+                    }
+                    rank -= compiled.m_Counts[child];
+                }
+                break;
+        }
+    }
+
+    inline void TemplateGenerator::EvaluateUniform(const CompiledTemplate& compiled, uint32_t node, Random& random, std::string& str) const {
+        NAGE_METRICS_DEPTH();
+        const CompiledTemplate::Node& n = compiled.m_Nodes[node];
+        switch(n.type) {
+            case CompiledTemplate::Type::LITERAL:
+                str.append(compiled.m_Pool, n.begin, n.count);
+                break;
+            case CompiledTemplate::Type::SYMBOL: {
+                uint32_t first = compiled.m_ValueStarts[n.begin];
+                uint32_t count = compiled.m_ValueStarts[n.begin + 1] - first;
+                str += Value(compiled.m_Values[first + (count > 1 ? random.NextBelow(count) : 0)]);
+                break;
+            }
+            case CompiledTemplate::Type::SEQUENCE:
+                for(uint32_t i = 0; i < n.count; i++)
+                    EvaluateUniform(compiled, compiled.m_Children[n.begin + i], random, str);
+                break;
+            case CompiledTemplate::Type::CHOICE: {
+                // Alternatives are picked in proportion to their names, in floating point
+                // once the count saturated. The first alternative is never a repeated one.
+                const uint32_t* children = &compiled.m_Children[n.begin];
+                uint32_t picked = children[0];
+                uint64_t total = compiled.m_Counts[node];
+                if(total == UINT64_MAX) {
+                    double sum = 0;
+                    for(uint32_t i = 0; i < n.count; i++)
+                        sum += (double) compiled.m_Counts[children[i]];
+                    double r = random.NextDouble() * sum;
+                    for(uint32_t i = 0; i < n.count; i++) {
+                        if(r < (double) compiled.m_Counts[children[i]]) {
+                            picked = children[i];
+                            break;
+                        }
+                        r -= (double) compiled.m_Counts[children[i]];
+                    }
+                }
+                else if(total > 1) {
+                    uint64_t r = random.NextBelow(total);
+                    for(uint32_t i = 0; i < n.count; i++) {
+                        if(r < compiled.m_Counts[children[i]]) {
+                            picked = children[i];
+                            break;
+                        }
+                        r -= compiled.m_Counts[children[i]];
+                    }
+                }
+                EvaluateUniform(compiled, picked, random, str);
+                break;
+            }
+        }
+    }
+
+    inline void TemplateGenerator::Count(CompiledTemplate& compiled) const {
+        // Children come before their parent, so nodes are counted in order. The text of nodes
+        // making a single name is kept to find alternatives repeating a former one.
+        using Type = CompiledTemplate::Type;
+        auto add = [](uint64_t a, uint64_t b) {
+            return (a > UINT64_MAX - b) ? UINT64_MAX : a + b;
+        };
+        auto multiply = [](uint64_t a, uint64_t b) {
+            return (a != 0 && b > UINT64_MAX / a) ? UINT64_MAX : a * b;
+        };
+
+        std::unordered_set<std::string_view> seen;
+        compiled.m_Values.clear();
+        compiled.m_ValueStarts.assign(1, 0);
+        for(const Template* t : compiled.m_Symbols) {
+            seen.clear();
+            for(uint32_t v = t->first; v < t->first + t->count; v++) {
+                if(seen.insert(Value(v)).second)
+                    compiled.m_Values.push_back(v);
+            }
+            compiled.m_ValueStarts.push_back(compiled.m_Values.size());
+        }
+
+        size_t size = compiled.m_Nodes.size();
+        compiled.m_Counts.assign(size, 0);
+        std::vector<std::string> texts(size);
+        std::vector<bool> isFixed(size, false);
+        for(uint32_t node = 0; node < size; node++) {
+            const CompiledTemplate::Node& n = compiled.m_Nodes[node];
+            uint64_t& count = compiled.m_Counts[node];
+            const uint32_t* children = compiled.m_Children.data() + n.begin;
+            switch(n.type) {
+                case Type::LITERAL:
+                    count = 1;
+                    isFixed[node] = true;
+                    texts[node] = compiled.m_Pool.substr(n.begin, n.count);
+                    break;
+                case Type::SYMBOL: {
+                    uint32_t first = compiled.m_ValueStarts[n.begin];
+                    count = compiled.m_ValueStarts[n.begin + 1] - first;
+                    isFixed[node] = (count == 1);
+                    if(isFixed[node])
+                        texts[node] = Value(compiled.m_Values[first]);
+                    break;
+                }
+                case Type::SEQUENCE:
+                    count = 1;
+                    isFixed[node] = true;
+                    for(uint32_t i = 0; i < n.count; i++) {
+                        count = multiply(count, compiled.m_Counts[children[i]]);
+                        isFixed[node] = isFixed[node] && isFixed[children[i]];
+                        if(isFixed[node])
+                            texts[node] += texts[children[i]];
+                    }
+                    if(!isFixed[node])
+                        texts[node].clear();
+                    break;
+                case Type::CHOICE: {
+                    seen.clear();
+                    uint32_t kept = 0, last = 0;
+                    for(uint32_t i = 0; i < n.count; i++) {
+                        if(isFixed[children[i]] && !seen.insert(texts[children[i]]).second) {
+                            compiled.m_Counts[children[i]] = 0;
+                            continue;
+                        }
+                        count = add(count, compiled.m_Counts[children[i]]);
+                        kept++;
+                        last = children[i];
+                    }
+                    isFixed[node] = (kept == 1 && isFixed[last]);
+                    if(isFixed[node])
+                        texts[node] = texts[last];
+                    break;
+                }
+            }
+        }
+    }
+
+    inline std::string TemplateGenerator::Evaluate(std::string& expr, bool isLiteral) {
+        std::string picked;
+        std::string str;
+        size_t alternatives = 0;
+        size_t i = 0;
 
-        // We loop character by character (UTF-8) until the expression is empty.
+        // We loop character by character (UTF-8) until the end of the group.
         // - If '(' then we call recursively.
-        // - If ')' then we pick a random value from the stack (values) and return it.
+        // - If ')' then we return the alternative picked so far.
         // - If '<' same thing but anything inside is a special symbol.
         // - If '>' same thing
-        // - If '|' then we push a new value on the stack.
+        // - If '|' then the current alternative replaces the picked one with probability
+        //   1/n (n alternatives seen), which picks one uniformly without storing them.
         // - Otherwise, depending on isLiteral, we push the string or the value associated to the key.
-        while(!expr.empty()) {
-            std::string ch = expr.substr(0, string::CharLength(expr[0]));
-            expr.erase(0, ch.size());
+        auto closeAlternative = [&]() {
+            alternatives++;
+            if(alternatives == 1 || GetRandom().NextBelow(alternatives) == 0)
+                picked.swap(str);
+            str.clear();
+        };
+        while(i < expr.size()) {
+            size_t length = std::min<size_t>(string::CharLength(expr[i]), expr.size() - i);
+            char c = length == 1 ? expr[i] : '\0';
+            i += length;
 
-            if(ch == "(") {
-                str += Evaluate(expr, true);
+            if(c == '(' || c == '<') {
+                expr.erase(0, i);
+                i = 0;
+                str += Evaluate(expr, c == '(');
             }
-            else if(ch == "<") {
-                str += Evaluate(expr, false);
-            }
-            else if(ch == ")" || ch == ">") {
+            else if(c == ')' || c == '>') {
                 break;
             }
-            else if(ch == "|") {
-                values[values.size()-1] += str;
-                values.push_back("");
-                str = "";
+            else if(c == '|') {
+                closeAlternative();
             }
             else if(isLiteral) {
-                str += ch;
+                str.append(expr, i - length, length);
             }
             else {
-                str += (m_Templates.count(ch) == 0 || m_Templates[ch].empty()) ? "" : m_Templates[ch][rand() % m_Templates[ch].size()];
+                const Template* t = FindTemplate(std::string_view(expr).substr(i - length, length));
+                if(t != nullptr)
+                    str += Sample(*t, GetRandom());
             }
         }
-        values[values.size()-1] += str;
+        expr.erase(0, i);
+        closeAlternative();
 
-        return (values.empty()) ? "" : values[rand()%values.size()];
+        return picked;
     }
 
     inline void TemplateGenerator::LoadTemplates(const std::string& fileName) {
-        m_Templates.clear();
+        ClearTemplates();
+        file::MappedFile file;
+        if(file.Open(fileName)) {
+            TemplateFile parsed;
+            ParseTemplates(file.View(), parsed);
+            MergeTemplates(parsed);
+        }
+        SetTemplate(m_Template);
+    }
 
-        std::ifstream file(fileName);
-        if(!file)
-            return;
+    inline void TemplateGenerator::LoadTemplates(const std::vector<std::string>& fileNames) {
+        LoadTemplates(fileNames, GetThreadPool());
+    }
 
-        enum Scope { KEY, VALUE };
+    inline void TemplateGenerator::LoadTemplates(const std::vector<std::string>& fileNames, ThreadPool& pool) {
+        // Files are parsed in parallel, then merged in order: a key defined again in a later
+        // file replaces the former definition. Missing files are skipped.
+        ClearTemplates();
+        std::vector<TemplateFile> parsed(fileNames.size());
+        pool.ForEach(fileNames.size(), [&](size_t i) {
+            file::MappedFile file;
+            if(file.Open(fileNames[i]))
+                ParseTemplates(file.View(), parsed[i]);
+        });
+        size_t characters = 0, values = 0;
+        for(auto& templates : parsed) {
+            characters += templates.pool.size();
+            values += templates.weights.size();
+        }
+        m_Pool.reserve(characters);
+        m_Offsets.reserve(values + 1);
+        m_Probabilities.reserve(values);
+        m_Aliases.reserve(values);
+        for(auto& templates : parsed)
+            MergeTemplates(templates);
+        SetTemplate(m_Template);
+    }
+
+    inline void TemplateGenerator::ParseTemplates(std::string_view text, TemplateFile& parsed) {
+        // Syntax: key=value1,value2:weight2,value3;
+        // Keys run up to '=' and may not contain ',' ';' '\n' ' ' '\'' '-' which are skipped.
+        // Values run up to ',' or ';' and may not contain '\n' which is skipped, an optional
+        // weight follows ':'. A missing or invalid weight counts as 1 and a value missing its
+        // terminator at the end of the file is dropped. Every delimiter is ASCII and cannot
+        // occur inside a multi-byte character, so bytes are scanned directly and runs between
+        // delimiters are copied at once.
+        const char* p = text.data();
+        const char* end = p + text.size();
         std::string key;
-        Scope scope = Scope::KEY;
+        parsed.offsets.assign(1, 0);
 
-        char c;
-        std::string str;
+        // Values are written through `out` into the pool sized for the whole text, and the
+        // weight of the current value into `weight`.
+        parsed.pool.resize(text.size());
+        char* pool = parsed.pool.data();
+        char* out = pool;
+        std::string weight;
 
-        while(file.get(c)) {
-            // Get UTF-8 character by looping over following bytes.
-            std::string ch = std::string(1, c);
-            for(size_t i = 1; i < string::CharLength(c); i++) {
-                if(!file.get(c))
-                    goto End;
-                ch += c;
-            }
-            // Syntax: key=value1,value2,value3;
-            // The scope can be key or value.
-            // - Operations for Scope::KEY are concatenating the key (a,b,c...) or switching to values (=)
-            // - Operations for Scope::VALUE are concatenating the value (a,b,c...), switching to next value (,)
-            //   or switching to next key (;)
-            // the following characters are not allowed in keys or values: ',' ';' '\n' ' ' '\'' '-'
-            switch(scope) {
-                case Scope::KEY:
-                    if(ch == "=") {
-                        key = str;
-                        str = "";
-                        m_Templates[key] = {};
-                        scope = Scope::VALUE;
-                    }
-                    else if(ch != "," && ch != ";" && ch != "\n" && ch != " " && ch != "'" && ch != "-") {
-                        str += ch;
-                    }
+        // Copies bytes to `out` up to a delimiter of `mask`, line feeds excluded.
+        enum : uint8_t { TEXT = 0, COMMA = 1, SEMICOLON = 2, COLON = 4, NEWLINE = 8 };
+        static constexpr std::array<uint8_t, 256> classes = [] {
+            std::array<uint8_t, 256> table = {};
+            table[','] = COMMA;
+            table[';'] = SEMICOLON;
+            table[':'] = COLON;
+            table['\n'] = NEWLINE;
+            return table;
+        }();
+        auto scan = [&](uint8_t mask) {
+            const char* run = p;
+            for(; p < end; p++) {
+                uint8_t type = classes[(uint8_t) *p];
+                if(type == TEXT)
+                    continue;
+                if(type & mask)
                     break;
-                case Scope::VALUE:
-                    if(ch == "," || ch == ";") {
-                        m_Templates[key].push_back(str);
-                        str = "";
-                        if(ch == ";")
-                            scope = Scope::KEY; 
-                    }
-                    else if(ch != "\n") {
-                        str += ch;
-                    }
+                if(type == NEWLINE) {
+                    memcpy(out, run, p - run);
+                    out += p - run;
+                    run = p + 1;
+                }
+            }
+            memcpy(out, run, p - run);
+            out += p - run;
+        };
+
+        while(p < end) {
+            key.clear();
+            for(; p < end && *p != '='; p++) {
+                char ch = *p;
+                if(ch != ',' && ch != ';' && ch != '\n' && ch != ' ' && ch != '\'' && ch != '-')
+                    key += ch;
+            }
+            if(p == end)
+                break;
+            p++;
+            uint32_t id = parsed.keys.Intern(key);
+            if(id >= parsed.templates.size())
+                parsed.templates.resize(id + 1);
+            Template& t = parsed.templates[id];
+            t.first = parsed.weights.size();
+            t.count = 0;
+
+            while(p < end) {
+                scan(COMMA | SEMICOLON | COLON);
+                double w = 1;
+                if(p < end && *p == ':') {
+                    // The weight is scanned like a value, then taken back from the pool.
+                    char* value = out;
+                    p++;
+                    scan(COMMA | SEMICOLON);
+                    weight.assign(value, out - value);
+                    out = value;
+                    char* last = nullptr;
+                    w = strtod(weight.c_str(), &last);
+                    if(weight.empty() || *last != '\0' || !(w >= 0))
+                        w = 1;
+                }
+                if(p == end)
+                    break;
+                parsed.weights.push_back(w);
+                parsed.offsets.push_back(out - pool);
+                t.count++;
+                if(*p++ == ';')
                     break;
             }
+            // Drop the characters of an unterminated value.
+            out = pool + parsed.offsets.back();
         }
-        
-        End:
-        file.close();
+        parsed.pool.resize(out - pool);
+
+        // Alias tables of the values of every template, built in place of the weights.
+        parsed.aliases.resize(parsed.weights.size());
+        std::vector<double> weights;
+        for(auto& t : parsed.templates) {
+            weights.assign(parsed.weights.begin() + t.first, parsed.weights.begin() + t.first + t.count);
+            WeightedSampler::BuildAlias(weights.data(), t.count, &parsed.weights[t.first], &parsed.aliases[t.first]);
+        }
+    }
+
+    inline void TemplateGenerator::MergeTemplates(TemplateFile& parsed) {
+        uint32_t first = m_Offsets.size() - 1;
+        uint32_t base = m_Pool.size();
+        m_Pool.append(parsed.pool.data(), parsed.pool.data() + parsed.pool.size());
+        for(size_t i = 1; i < parsed.offsets.size(); i++)
+            m_Offsets.push_back(base + parsed.offsets[i]);
+        m_Probabilities.append(parsed.weights.data(), parsed.weights.data() + parsed.weights.size());
+        m_Aliases.append(parsed.aliases.data(), parsed.aliases.data() + parsed.aliases.size());
+        for(uint32_t id = 0; id < parsed.templates.size(); id++) {
+            uint32_t key = m_Keys.Intern(parsed.keys.Key(id));
+            if(key >= m_Templates.size())
+                m_Templates.resize(key + 1);
+            m_Templates[key] = Template{parsed.templates[id].first + first, parsed.templates[id].count};
+        }
+    }
+
+    inline void TemplateGenerator::ClearTemplates() {
+        m_Keys.Clear();
+        m_Templates.clear();
+        m_Pool.clear();
+        m_Offsets.assign(1, 0);
+        m_Probabilities.clear();
+        m_Aliases.clear();
+    }
+
+    inline const TemplateGenerator::Template* TemplateGenerator::FindTemplate(std::string_view key) const {
+        uint32_t id = m_Keys.Find(key);
+        if(id == SymbolTable::NONE || m_Templates[id].count == 0)
+            return nullptr;
+        return &m_Templates[id];
+    }
+
+    inline std::string_view TemplateGenerator::Value(uint32_t value) const {
+        return std::string_view(m_Pool.data() + m_Offsets[value], m_Offsets[value + 1] - m_Offsets[value]);
+    }
+
+    inline std::string_view TemplateGenerator::Sample(const Template& t, Random& random) const {
+        return Value(t.first + WeightedSampler::SampleAlias(&m_Probabilities[t.first], &m_Aliases[t.first], t.count, random.NextDouble()));
+    }
+
+    /***********************************************************
+    *                     FACE GENERATOR                       *
+    ***********************************************************/
+
+    inline FaceGenerator::FaceGenerator() {
+        m_Width = 0;
+        m_Height = 0;
+    }
+
+    inline FaceGenerator::FaceGenerator(const std::string& fileName) : FaceGenerator() {
+        LoadParts(fileName);
+    }
+
+    inline std::string FaceGenerator::Generate() {
+        std::string face;
+        GenerateInto(face);
+        return face;
+    }
+
+    inline void FaceGenerator::GenerateInto(std::string& out) {
+        NAGE_METRICS_SCOPE(1, &out);
+        out.assign(m_Blank);
+        if(!m_Layers.empty())
+            Compose(GetRandom(), out.data());
+    }
+
+    inline void FaceGenerator::GenerateN(size_t count, NameTable& out) {
+        if(m_Layers.empty())
+            return;
+        NAGE_METRICS_SCOPE(count, &out.Buffer());
+        Random& random = GetRandom();
+        out.Reserve(count, count * m_Blank.size());
+        for(size_t i = 0; i < count; i++) {
+            std::string& data = out.Buffer();
+            size_t begin = data.size();
+            data.append(m_Blank);
+            Compose(random, data.data() + begin);
+            out.Push();
+        }
+    }
+
+    inline void FaceGenerator::LoadParts(const std::string& fileName) {
+        m_Parts.clear();
+        m_Layers.clear();
+
+        file::MappedFile file;
+        if(!file.Open(fileName)) {
+            Compile();
+            return;
+        }
+
+        auto trim = [](std::string_view str) {
+            size_t begin = str.find_first_not_of(" \t\r\n");
+            if(begin == std::string_view::npos)
+                return std::string_view();
+            return str.substr(begin, str.find_last_not_of(" \t\r\n") - begin + 1);
+        };
+
+        // Statements end with ';', the only multi-line value being the glyphs of `str`.
+        std::string_view text = file.View();
+        std::vector<std::string> types;
+        std::vector<std::string> partTypes;
+        while(!text.empty()) {
+            size_t end = std::min(text.find(';'), text.size());
+            std::string_view statement = text.substr(0, end);
+            text.remove_prefix(std::min(end + 1, text.size()));
+
+            size_t equal = statement.find('=');
+            if(equal == std::string_view::npos)
+                continue;
+            std::string_view key = trim(statement.substr(0, equal));
+            std::string_view value = statement.substr(equal + 1);
+
+            if(key == "id") {
+                m_Parts.emplace_back();
+                m_Parts.back().id = trim(value);
+                partTypes.emplace_back();
+            }
+            else if(m_Parts.empty()) {
+                continue;
+            }
+            else if(key == "type") {
+                partTypes.back() = trim(value);
+            }
+            else if(key == "pos") {
+                std::string pos(trim(value));
+                m_Parts.back().row = (uint32_t) strtoul(pos.c_str(), nullptr, 10);
+                size_t comma = pos.find(',');
+                if(comma != std::string::npos)
+                    m_Parts.back().column = (uint32_t) strtoul(pos.c_str() + comma + 1, nullptr, 10);
+            }
+            else if(key == "str") {
+                // The glyphs start on the line following `str=`.
+                if(!value.empty() && value[0] == '\r')
+                    value.remove_prefix(1);
+                if(!value.empty() && value[0] == '\n')
+                    value.remove_prefix(1);
+                std::vector<std::string>& lines = m_Parts.back().lines;
+                lines.clear();
+                while(!value.empty()) {
+                    size_t newline = std::min(value.find('\n'), value.size());
+                    std::string_view line = value.substr(0, newline);
+                    if(!line.empty() && line.back() == '\r')
+                        line.remove_suffix(1);
+                    lines.emplace_back(line);
+                    value.remove_prefix(std::min(newline + 1, value.size()));
+                }
+            }
+        }
+
+        for(size_t i = 0; i < m_Parts.size(); i++) {
+            auto it = std::find_if(m_Layers.begin(), m_Layers.end(), [&](const Layer& layer) {
+                return layer.type == partTypes[i];
+            });
+            if(it == m_Layers.end()) {
+                m_Layers.push_back({partTypes[i], {}});
+                it = m_Layers.end() - 1;
+            }
+            it->parts.push_back(i);
+        }
+        Compile();
+    }
+
+    inline size_t FaceGenerator::Size() const {
+        return m_Parts.size();
+    }
+
+    inline size_t FaceGenerator::Width() const {
+        return m_Width;
+    }
+
+    inline size_t FaceGenerator::Height() const {
+        return m_Height;
+    }
+
+    inline void FaceGenerator::Compile() {
+        m_Width = 0;
+        m_Height = 0;
+        for(Part& part : m_Parts) {
+            part.height = part.lines.size();
+            for(auto& line : part.lines)
+                m_Width = std::max(m_Width, part.column + line.size());
+            m_Height = std::max<size_t>(m_Height, part.row + part.height);
+        }
+
+        // Rows of a part are laid out over the whole canvas width, blank cells masked out.
+        m_Glyphs.clear();
+        m_Masks.clear();
+        m_IsOpaque.clear();
+        uint32_t rows = 0;
+        for(Part& part : m_Parts) {
+            part.first = rows;
+            for(auto& line : part.lines) {
+                std::string glyphs(m_Width, ' ');
+                std::string mask(m_Width, '\0');
+                glyphs.replace(part.column, line.size(), line);
+                for(size_t i = 0; i < line.size(); i++)
+                    mask[part.column + i] = line[i] != ' ' ? (char) 0xFF : '\0';
+                m_Glyphs += glyphs;
+                m_Masks += mask;
+                m_IsOpaque.push_back(mask.find('\0') == std::string::npos);
+                rows++;
+            }
+        }
+
+        m_Blank.clear();
+        for(size_t i = 0; i < m_Height; i++) {
+            m_Blank.append(m_Width, ' ');
+            if(i + 1 < m_Height)
+                m_Blank += '\n';
+        }
+    }
+
+    inline void FaceGenerator::Compose(Random& random, char* canvas) const {
+        const size_t stride = m_Width + 1;
+        for(const Layer& layer : m_Layers) {
+            const Part& part = m_Parts[layer.parts[random.NextBelow(layer.parts.size())]];
+            for(size_t r = 0; r < part.height; r++) {
+                size_t row = part.first + r;
+                char* dst = canvas + (part.row + r) * stride;
+                const char* glyphs = m_Glyphs.data() + row * m_Width;
+                if(m_IsOpaque[row]) {
+                    memcpy(dst, glyphs, m_Width);
+                    continue;
+                }
+                const char* mask = m_Masks.data() + row * m_Width;
+                for(size_t i = 0; i < m_Width; i++)
+                    dst[i] = (char) ((dst[i] & ~mask[i]) | (glyphs[i] & mask[i]));
+            }
+        }
+    }
+
+    /***********************************************************
+    *                          IMAGE                           *
+    ***********************************************************/
+
+    inline bool Image::Save(const Handler::Registry& registry, const std::string& fileName, std::vector<uint32_t>* skipped) {
+        // Generators go in key order, so that a handler always gives the same image. Types
+        // are matched exactly: a derived class may hold state the image would lose. The keys
+        // of the generators which cannot be saved are appended to `skipped`.
+        std::vector<std::pair<uint32_t, const Generator*>> generators;
+        for(auto& [key, generator] : registry)
+            generators.emplace_back(key, generator.get());
+        std::sort(generators.begin(), generators.end());
+
+        Writer writer;
+        std::vector<Entry> entries;
+        for(auto& [key, generator] : generators) {
+            Entry entry = {};
+            entry.key = key;
+            entry.firstSection = writer.first = writer.sections.size();
+            size_t size = writer.data.size();
+            const std::type_info& type = generator != nullptr ? typeid(*generator) : typeid(void);
+            bool isSaved = false;
+            if(type == typeid(ListGenerator)) {
+                entry.type = LIST;
+                isSaved = SaveList(static_cast<const ListGenerator&>(*generator), writer);
+            }
+            else if(type == typeid(MarkovChainGenerator)) {
+                entry.type = MARKOV;
+                isSaved = SaveMarkov(static_cast<const MarkovChainGenerator&>(*generator), writer, entry);
+            }
+            else if(type == typeid(TemplateGenerator)) {
+                entry.type = TEMPLATE;
+                isSaved = SaveTemplates(static_cast<const TemplateGenerator&>(*generator), writer);
+            }
+            if(!isSaved) {
+                writer.sections.resize(entry.firstSection);
+                writer.data.resize(size);
+                if(skipped != nullptr)
+                    skipped->push_back(key);
+                continue;
+            }
+            entry.sectionCount = writer.sections.size() - entry.firstSection;
+            entries.push_back(entry);
+        }
+
+        // Sections were placed relative to the arrays, which start after the tables.
+        size_t tables = sizeof(Header) + entries.size() * sizeof(Entry) + writer.sections.size() * sizeof(Section);
+        size_t base = (tables + 15) & ~(size_t) 15;
+        for(Section& section : writer.sections)
+            section.offset += base;
+        std::string buffer(base, '\0');
+        memcpy(&buffer[sizeof(Header)], entries.data(), entries.size() * sizeof(Entry));
+        memcpy(&buffer[sizeof(Header) + entries.size() * sizeof(Entry)], writer.sections.data(), writer.sections.size() * sizeof(Section));
+
+        Header header = {};
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.endianness = ENDIANNESS;
+        header.entryCount = entries.size();
+        header.sectionCount = writer.sections.size();
+        header.payloadSize = base - sizeof(Header) + writer.data.size();
+        header.tableChecksum = file::Hash(buffer.data() + sizeof(Header), base - sizeof(Header));
+        header.checksum = file::Hash(writer.data.data(), writer.data.size(), header.tableChecksum);
+        memcpy(&buffer[0], &header, sizeof(Header));
+
+        return file::Replace(fileName, {buffer, writer.data});
+    }
+
+    inline bool Image::Load(const std::string& fileName, Handler::Registry& registry, bool isVerified) {
+        // The header and tables are always checked, and so are the bounds of every array.
+        // `isVerified` also checks the checksum of the arrays and every index they hold,
+        // which reads the whole image.
+        auto mapped = std::make_shared<file::MappedFile>(fileName);
+        if(!mapped->IsOpen() || mapped->Size() < sizeof(Header))
+            return false;
+
+        Header header;
+        memcpy(&header, mapped->Data(), sizeof(Header));
+        if(memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION || header.endianness != ENDIANNESS)
+            return false;
+        uint64_t tables = sizeof(Header) + (uint64_t) header.entryCount * sizeof(Entry) + (uint64_t) header.sectionCount * sizeof(Section);
+        uint64_t base = (tables + 15) & ~(uint64_t) 15;
+        if(header.payloadSize != mapped->Size() - sizeof(Header) || base > mapped->Size())
+            return false;
+        if(file::Hash(mapped->Data() + sizeof(Header), base - sizeof(Header)) != header.tableChecksum)
+            return false;
+        if(isVerified && file::Hash(mapped->Data() + base, mapped->Size() - base, header.tableChecksum) != header.checksum)
+            return false;
+
+        const Entry* entries = (const Entry*) (mapped->Data() + sizeof(Header));
+        Reader reader;
+        reader.mapping = mapped;
+        for(uint32_t i = 0; i < header.entryCount; i++) {
+            const Entry& entry = entries[i];
+            if(entry.firstSection > header.sectionCount || entry.sectionCount > header.sectionCount - entry.firstSection)
+                return false;
+            reader.entry = &entry;
+            reader.sections = (const Section*) (mapped->Data() + sizeof(Header) + header.entryCount * sizeof(Entry)) + entry.firstSection;
+
+            std::shared_ptr<Generator> generator;
+            if(entry.type == LIST)
+                generator = LoadList(reader, isVerified);
+            else if(entry.type == MARKOV)
+                generator = LoadMarkov(reader, isVerified);
+            else if(entry.type == TEMPLATE)
+                generator = LoadTemplates(reader, isVerified);
+            if(generator == nullptr || !registry.emplace(entry.key, std::move(generator)).second)
+                return false;
+        }
+        return true;
+    }
+
+    inline void Image::Writer::Add(const void* elements, size_t elementSize, size_t count) {
+        data.resize((data.size() + 15) & ~(size_t) 15, '\0');
+        sections.push_back({(uint32_t) (sections.size() - first), (uint32_t) elementSize, data.size(), count});
+        if(count > 0)
+            data.append((const char*) elements, elementSize * count);
+    }
+
+    template<typename T> inline bool Image::Reader::Borrow(Array<T>& array, uint32_t id) const {
+        if(id >= entry->sectionCount)
+            return false;
+        const Section& section = sections[id];
+        if(section.id != id || section.elementSize != sizeof(T) || section.offset % 16 != 0 || section.offset > mapping->Size()
+            || section.count > (mapping->Size() - section.offset) / sizeof(T))
+            return false;
+        array.Borrow((const T*) (mapping->Data() + section.offset), section.count, mapping);
+        return true;
+    }
+
+    inline bool Image::SaveList(const ListGenerator& list, Writer& writer) {
+        // Tokens and mapped lines become a single mapped list: lines ended by '\n' and their
+        // starts, 32 bits wide like those of mapped files.
+        std::string lines;
+        std::vector<uint32_t> starts;
+        starts.reserve(list.Size() + 1);
+        for(size_t i = 0; i < list.Size(); i++) {
+            std::string_view token = list.At(i);
+            starts.push_back(lines.size());
+            lines.append(token);
+            lines += '\n';
+            if(lines.size() >= UINT32_MAX)
+                return false;
+        }
+        starts.push_back(lines.size());
+        writer.Add(lines.data(), sizeof(char), lines.size());
+        writer.Add(starts.data(), sizeof(uint32_t), starts.size());
+        return true;
+    }
+
+    inline bool Image::SaveMarkov(const MarkovChainGenerator& markov, Writer& writer, Entry& entry) {
+        // The model without its index, like in a cache. Counts are rebuilt from the edges
+        // and the pruned counts when the chain is updated.
+        const MarkovModel& model = markov.m_Model;
+        entry.order = markov.m_Order;
+        entry.start = model.start;
+        entry.end = model.end;
+        entry.minCount = markov.m_Smoothing.minCount;
+        entry.discount = markov.m_Smoothing.discount;
+        entry.sourceSize = markov.m_Source.size;
+        entry.sourceTime = markov.m_Source.time;
+        entry.sourceHash = markov.m_Source.hash;
+        writer.Add(model.symbols.data(), sizeof(uint32_t), model.symbols.size());
+        writer.Add(model.lengths.data(), sizeof(uint8_t), model.lengths.size());
+        writer.Add(model.offsets.data(), sizeof(uint32_t), model.offsets.size());
+        writer.Add(model.edges.data(), sizeof(MarkovModel::Edge), model.edges.size());
+        writer.Add(model.pruned.data(), sizeof(uint32_t), model.pruned.size());
+        return true;
+    }
+
+    inline bool Image::SaveTemplates(const TemplateGenerator& templates, Writer& writer) {
+        // Keys back to back and their offsets, interned again on load, then the value tables.
+        std::string keys;
+        std::vector<uint32_t> keyOffsets(1, 0);
+        for(uint32_t id = 0; id < templates.m_Keys.Size(); id++) {
+            keys.append(templates.m_Keys.Key(id));
+            keyOffsets.push_back(keys.size());
+        }
+        writer.Add(keys.data(), sizeof(char), keys.size());
+        writer.Add(keyOffsets.data(), sizeof(uint32_t), keyOffsets.size());
+        writer.Add(templates.m_Templates.data(), sizeof(TemplateGenerator::Template), templates.m_Templates.size());
+        writer.Add(templates.m_Pool.data(), sizeof(char), templates.m_Pool.size());
+        writer.Add(templates.m_Offsets.data(), sizeof(uint32_t), templates.m_Offsets.size());
+        writer.Add(templates.m_Probabilities.data(), sizeof(double), templates.m_Probabilities.size());
+        writer.Add(templates.m_Aliases.data(), sizeof(uint32_t), templates.m_Aliases.size());
+        return true;
+    }
+
+    inline std::shared_ptr<Generator> Image::LoadList(const Reader& reader, bool isVerified) {
+        auto list = std::make_shared<ListGenerator>();
+        Array<char> lines;
+        ListGenerator::MappedList mapped;
+        if(reader.entry->sectionCount != 2 || !reader.Borrow(lines, 0) || !reader.Borrow(mapped.starts, 1))
+            return nullptr;
+        if(mapped.starts.empty() || mapped.starts.back() != lines.size())
+            return nullptr;
+        if(isVerified) {
+            // Every line holds at least its '\n'.
+            const Array<uint32_t>& starts = mapped.starts;
+            for(size_t i = 0; i + 1 < starts.size(); i++) {
+                if(starts[i] >= starts[i + 1])
+                    return nullptr;
+            }
+        }
+        if(mapped.starts.size() > 1) {
+            mapped.owner = reader.mapping;
+            mapped.data = std::as_const(lines).data();
+            list->m_Size = mapped.starts.size() - 1;
+            list->m_Lists.push_back(std::move(mapped));
+        }
+        return list;
+    }
+
+    inline std::shared_ptr<Generator> Image::LoadMarkov(const Reader& reader, bool isVerified) {
+        const Entry& entry = *reader.entry;
+        if(entry.sectionCount != 5 || entry.order == 0 || entry.order > UINT8_MAX)
+            return nullptr;
+        auto markov = std::make_shared<MarkovChainGenerator>((int) entry.order);
+        MarkovModel& model = markov->m_Model;
+        if(!reader.Borrow(model.symbols, 0) || !reader.Borrow(model.lengths, 1) || !reader.Borrow(model.offsets, 2) || !reader.Borrow(model.edges, 3)
+            || !reader.Borrow(model.pruned, 4))
+            return nullptr;
+        model.order = entry.order;
+        model.start = entry.start;
+        model.end = entry.end;
+        model.smoothing.minCount = entry.minCount;
+        model.smoothing.discount = entry.discount;
+        if(!model.Empty() && !model.IsConsistent(isVerified))
+            return nullptr;
+
+        markov->m_Smoothing = model.smoothing;
+        markov->m_Source.size = entry.sourceSize;
+        markov->m_Source.time = entry.sourceTime;
+        markov->m_Source.hash = entry.sourceHash;
+        markov->m_HasCounts = false;
+        return markov;
+    }
+
+    inline std::shared_ptr<Generator> Image::LoadTemplates(const Reader& reader, bool isVerified) {
+        auto generator = std::make_shared<TemplateGenerator>();
+        TemplateGenerator& templates = *generator;
+        Array<char> keys;
+        Array<uint32_t> keyOffsets;
+        if(reader.entry->sectionCount != 7 || !reader.Borrow(keys, 0) || !reader.Borrow(keyOffsets, 1)
+            || !reader.Borrow(templates.m_Templates, 2) || !reader.Borrow(templates.m_Pool, 3) || !reader.Borrow(templates.m_Offsets, 4)
+            || !reader.Borrow(templates.m_Probabilities, 5) || !reader.Borrow(templates.m_Aliases, 6))
+            return nullptr;
+
+        // Checks read through const references, which keep the arrays borrowed.
+        const Array<uint32_t>& starts = keyOffsets;
+        const Array<uint32_t>& offsets = templates.m_Offsets;
+        const Array<uint32_t>& aliases = templates.m_Aliases;
+        const Array<TemplateGenerator::Template>& table = templates.m_Templates;
+        size_t values = templates.m_Probabilities.size();
+        if(starts.size() != table.size() + 1 || starts.back() > keys.size()
+            || offsets.size() != values + 1 || aliases.size() != values || offsets.back() > templates.m_Pool.size())
+            return nullptr;
+        for(uint32_t id = 0; id + 1 < starts.size(); id++) {
+            if(starts[id] > starts[id + 1])
+                return nullptr;
+            std::string_view key(std::as_const(keys).data() + starts[id], starts[id + 1] - starts[id]);
+            if(templates.m_Keys.Intern(key) != id)
+                return nullptr;
+        }
+
+        if(isVerified) {
+            for(size_t i = 0; i < values; i++) {
+                if(offsets[i] > offsets[i + 1])
+                    return nullptr;
+            }
+            for(const TemplateGenerator::Template& t : table) {
+                if(t.first > values || t.count > values - t.first)
+                    return nullptr;
+                for(uint32_t v = t.first; v < t.first + t.count; v++) {
+                    if(aliases[v] >= t.count)
+                        return nullptr;
+                }
+            }
+        }
+        return generator;
     }
 
 }